@@ -0,0 +1,61 @@
+#!/bin/bash
+# 跑bench/下的所有负载：每个跑RUNS遍，取min和median，
+# 和baseline.json里的基线对比，median慢超过THRESHOLD%算回归（退出码非0）。
+# baseline跟机器相关，换机器后用 ./run.sh --update 重建基线
+cd "$(dirname "$0")" || exit 1
+
+RUNS=${RUNS:-5}
+THRESHOLD=${THRESHOLD:-25}
+UPDATE=0
+if [ "$1" = "--update" ]; then
+    UPDATE=1
+fi
+
+if [ ! -x ../main ]; then
+    echo "../main not built; run 'make bench' from clox/" >&2
+    exit 1
+fi
+
+FAIL=0
+RESULTS=""
+
+for bench in *.lox; do
+    name="${bench%.lox}"
+    times=""
+    for _ in $(seq "$RUNS"); do
+        t=$(../main "$bench") || exit 1
+        times="$times $t"
+    done
+    sorted=$(echo "$times" | tr ' ' '\n' | sed '/^$/d' | sort -g)
+    min=$(echo "$sorted" | head -1)
+    median=$(echo "$sorted" | sed -n "$(( (RUNS + 1) / 2 ))p")
+
+    base=""
+    if [ -f baseline.json ] && [ "$UPDATE" = 0 ]; then
+        base=$(sed -n "s/.*\"$name\": *\([0-9.]*\).*/\1/p" baseline.json)
+    fi
+
+    if [ -n "$base" ]; then
+        # 和基线的中位数差多少个百分点
+        delta=$(awk -v m="$median" -v b="$base" -v t="$THRESHOLD" \
+            'BEGIN { d = (m - b) / b * 100; printf "%+.1f%%", d; exit (d > t) }') \
+            || { delta="$delta REGRESSION"; FAIL=1; }
+        printf "%-10s min %8.4f  median %8.4f  baseline %8.4f  %s\n" \
+            "$name" "$min" "$median" "$base" "$delta"
+    else
+        printf "%-10s min %8.4f  median %8.4f\n" "$name" "$min" "$median"
+    fi
+
+    RESULTS="$RESULTS    \"$name\": $median,"$'\n'
+done
+
+if [ "$UPDATE" = 1 ]; then
+    {
+        echo "{"
+        printf '%s' "$RESULTS" | sed '$ s/,$//'
+        echo "}"
+    } > baseline.json
+    echo "baseline.json updated"
+fi
+
+exit $FAIL
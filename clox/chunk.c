@@ -1,13 +1,20 @@
 #include "chunk.h"
+#include <stddef.h>
 #include <stdlib.h>
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
-    chunk->lines = NULL;
+    chunk->lineRuns = NULL;
+    chunk->lineRunCount = 0;
+    chunk->lineRunCapacity = 0;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
     initValueArray(
         &chunk->constants);  // 将constants字段的指针传入函数中，进行初始化
 }
@@ -15,8 +22,10 @@ void initChunk(Chunk* chunk) {
 void freeChunk(Chunk* chunk) {
     // 释放code数组
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    // 释放lines数组
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    // 释放行号游程数组
+    FREE_ARRAY(LineRun, chunk->lineRuns, chunk->lineRunCapacity);
+    // 释放内联缓存数组
+    FREE_ARRAY(PropertyCache, chunk->caches, chunk->cacheCapacity);
     // 释放常量
     freeValueArray(&chunk->constants);
     // chunk置零
@@ -32,23 +41,67 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         // 新code数组
         chunk->code =
             GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        // lines和code是长度相同的，也要做相同操作
-        chunk->lines =
-            GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    // 行号按游程压缩：还在上一条游程的行里就只加计数
+    if (chunk->lineRunCount > 0 &&
+        chunk->lineRuns[chunk->lineRunCount - 1].line == line) {
+        chunk->lineRuns[chunk->lineRunCount - 1].count++;
+        return;
+    }
+    if (chunk->lineRunCapacity < chunk->lineRunCount + 1) {
+        int oldCapacity = chunk->lineRunCapacity;
+        chunk->lineRunCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lineRuns = GROW_ARRAY(LineRun, chunk->lineRuns, oldCapacity,
+                                     chunk->lineRunCapacity);
+    }
+    chunk->lineRuns[chunk->lineRunCount].line = line;
+    chunk->lineRuns[chunk->lineRunCount].count = 1;
+    chunk->lineRunCount++;
+}
+
+int getLine(Chunk* chunk, int offset) {
+    // 顺着游程累加字节数，找到覆盖offset的那一段。
+    // 只有报错和反汇编会查，线性扫描足够了
+    int covered = 0;
+    for (int i = 0; i < chunk->lineRunCount; i++) {
+        covered += chunk->lineRuns[i].count;
+        if (offset < covered) {
+            return chunk->lineRuns[i].line;
+        }
+    }
+    return -1;
 }
 
 
 
+int addCache(Chunk* chunk) {
+    // 和code数组一样按需扩容
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(PropertyCache, chunk->caches, oldCapacity,
+                                   chunk->cacheCapacity);
+    }
+
+    // 新缓存初始为空，klass==NULL时永远不会命中
+    chunk->caches[chunk->cacheCount].klass = NULL;
+    chunk->caches[chunk->cacheCount].method = NIL_VAL;
+    return chunk->cacheCount++;
+}
+
 int addConstant(Chunk* chunk, Value value) {
     // 先向VM的栈中push再pop，防止过程中GC回收
     push(value);
     // 向数组中写入常量值
     writeValueArray(&chunk->constants, value);
+    // chunk内嵌在ObjFunction里，写常量相当于向函数对象里写了一个引用。
+    // 编译中函数如果已经晋升到老年代，需要进记忆集。
+    writeBarrier(
+        (Obj*)((uint8_t*)chunk - offsetof(ObjFunction, chunk)));
     pop();
     // 返回改常量在数组中的索引
     return chunk->constants.count - 1;
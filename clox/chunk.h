@@ -42,18 +42,80 @@ typedef enum {
     OP_RETURN,  // 返回
     OP_CLASS,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    // ---- 下面是窥孔优化合并出来的超级指令，编译器不直接发出 ----
+    OP_NOP,  // 空指令。指令合并后多出来的字节用它填充，保持跳转偏移不变
+    OP_GET_LOCAL2,     // 连续读两个本地变量，后面跟两个槽索引
+    OP_NOT_EQUAL,      // OP_EQUAL + OP_NOT
+    OP_GREATER_EQUAL,  // OP_LESS + OP_NOT
+    OP_LESS_EQUAL,     // OP_GREATER + OP_NOT
+    OP_CONSTANT_ADD,  // OP_CONSTANT + OP_ADD，后面跟常量索引
+    // ---- 运行时量化（quickening)出来的专用指令，编译器不直接发出 ----
+    // 通用算术指令首次成功执行后会把自己改写成对应的专用版本，
+    // 跳过完整的类型分支；一旦再遇到不符合的类型就改写回通用指令
+    OP_ADD_NUMBER,       // 确认过两个操作数都是数字的OP_ADD
+    OP_ADD_STRING,       // 确认过两个操作数都是字符串/rope的OP_ADD
+    OP_SUBTRACT_NUMBER,  // 数字版OP_SUBTRACT
+    OP_MULTIPLY_NUMBER,  // 数字版OP_MULTIPLY
+    OP_DIVIDE_NUMBER,    // 数字版OP_DIVIDE
+    // ---- 宽操作数指令，常量池超过256个时使用 ----
+    OP_CONSTANT_LONG,  // 常量，后面跟24位（3字节，大端）常量索引
+    OP_CLOSURE_LONG,   // 闭包声明，后面跟24位函数常量索引和闭包变量对
+    OP_BUILD_LIST,  // 列表字面量，后面跟元素数量，从栈上收集这么多个元素
+    OP_GET_INDEX,  // 下标读 list[i]，栈上依次是列表和索引
+    OP_SET_INDEX,  // 下标写 list[i] = v，栈上依次是列表、索引和值
+    OP_TAIL_CALL,  // 尾位置的函数调用（return f(...)），复用当前帧。
+                   // 操作数和OP_CALL一样是入参数量，后面保留的OP_RETURN
+                   // 只有走不了复用路径（native、类构造等）时才会执行到
+    // ---- 宽全局槽指令，全局变量超过256个时使用（放在枚举末尾，
+    // 已有指令编号不变，旧的.clxb文件可以照常加载）----
+    OP_GET_GLOBAL_LONG,     // 全局变量获取，后面跟24位（3字节，大端）槽索引
+    OP_DEFINE_GLOBAL_LONG,  // 全局变量定义，24位槽索引
+    OP_SET_GLOBAL_LONG,     // 全局变量设置，24位槽索引
+    // ---- 带名字常量的指令的宽版本。名字和字面量共用常量池，
+    // 字面量多的chunk里名字的索引一样会超过255 ----
+    OP_GET_PROPERTY_LONG,  // 字段获取，24位名字索引 + 1字节缓存槽
+    OP_SET_PROPERTY_LONG,  // 字段赋值，24位名字索引
+    OP_INVOKE_LONG,      // 方法调用，24位名字索引 + 入参数量 + 1字节缓存槽
+    OP_GET_SUPER_LONG,   // 父类方法获取，24位名字索引
+    OP_SUPER_INVOKE_LONG,  // 父类方法调用，24位名字索引 + 入参数量
+    OP_CLASS_LONG,         // 类声明，24位类名索引
+    OP_METHOD_LONG         // 方法定义，24位方法名索引
 } OpCode;
 
+// 属性访问点的内联缓存。记录该访问点上一次解析出的类和方法，
+// 下次同一个类的实例再经过这里时直接复用，跳过方法表的哈希探测。
+typedef struct {
+    struct ObjClass* klass;  // 上一次看到的类，NULL代表缓存为空
+    Value method;            // 在klass中解析出的方法（闭包对象）
+} PropertyCache;
+
+// 缓存槽操作数是1字节，0xFF保留作"无缓存"哨兵：一个chunk里超过255个
+// 访问点之后，多出来的访问点带这个哨兵，每次都走慢路径但程序照常编译
+#define CACHE_NONE UINT8_MAX
+
+// 一段连续指令的行号游程。相邻指令几乎都在同一行，
+// 按「行号+字节数」压缩后行号信息只占原来的零头
+typedef struct {
+    int line;   // 源码行号
+    int count;  // 连续多少个code字节在这一行
+} LineRun;
+
 // 代表一段被编译后的代码
 typedef struct {
     int count;     // 指令数量
     int capacity;  // 指令数组当前总容量（需要适时扩容数组）
     uint8_t* code;  // 指令数组。代码全部被编译成了这一串指令。
-    int* lines;     // 代码行数数组。 lines[i] 代码 code[i]
-                    // 指令在源码中的行数，方便异常信息打印。
+    LineRun* lineRuns;  // 行号游程数组，替代逐字节的行号表。
+                        // 只有报错和反汇编才查行号，查询慢一点无所谓
+    int lineRunCount;     // 游程数量
+    int lineRunCapacity;  // 游程数组容量
     ValueArray
         constants;  // 常量数组，为了保持code数组精简，代码中的常量都被按顺序存在constants里面，code里存放的常量值的是constants数组的索引。
+    int cacheCount;         // 内联缓存数量
+    int cacheCapacity;      // caches数组当前总容量
+    PropertyCache* caches;  // 内联缓存数组。每个属性访问/方法调用点占一个，
+                            // 指令里跟着它在这个数组中的索引。
 } Chunk;
 
 /**
@@ -88,4 +150,21 @@ void freeChunk(Chunk* chunk);
  */
 int addConstant(Chunk* chunk, Value value);
 
+/**
+ * @brief 向chunk中新增一个空的内联缓存
+ *
+ * @param chunk 指针
+ * @return int 缓存在caches中的索引
+ */
+int addCache(Chunk* chunk);
+
+/**
+ * @brief 查询code[offset]对应的源码行号
+ *
+ * @param chunk 指针
+ * @param offset 指令在code数组中的位置
+ * @return int 行号，查不到返回-1
+ */
+int getLine(Chunk* chunk, int offset);
+
 #endif
\ No newline at end of file
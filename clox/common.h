@@ -5,6 +5,19 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// 开启后Value使用NaN
+// boxing表示法，把nil/bool/对象指针/数字全部打包进一个64位字，
+// 栈和常量池的内存占用减半，valuesEqual退化成一次整数比较。
+#define NAN_BOXING
+
+// 在GCC/Clang下run()使用computed
+// goto做直接线索化分发：每个opcode的handler结尾各自goto下一条指令的label，
+// CPU可以为每个handler单独做间接跳转预测，比单个大switch的命中率高得多。
+// 不支持computed goto的编译器会自动退回可移植的switch分发。
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_DISPATCH
+#endif
+
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 
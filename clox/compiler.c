@@ -6,6 +6,7 @@
 #include "compiler.h"
 #include "memory.h"
 #include "scanner.h"
+#include "vm.h"
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
@@ -71,6 +72,16 @@ typedef enum {
     TYPE_SCRIPT        // 全局（整个lox脚本也认为是一个函数）
 } FunctionType;
 
+// 编译期常量interning表：常量值 -> 常量池索引。开放寻址，malloc管理，
+// 做法和serialize.c里的对象id表一样。常量池很小的时候线性扫更快，
+// 池子长过阈值之后才建表（见internConstant）
+typedef struct {
+    Value* keys;   // 常量值。字符串全局interned，指针相等即值相等
+    int* indexes;  // keys[i]在常量池里的索引，-1代表空槽
+    int count;     // 已占用槽数量
+    int capacity;  // 总槽数，2的幂
+} ConstantMap;
+
 // 正在执行的Compiler
 typedef struct Compiler {
     // Compiler栈，指向上一层函数的Compiler。每解析到一个函数会新建一个专用compiler，记录上一层的，结束之后会还原。
@@ -83,6 +94,11 @@ typedef struct Compiler {
     int localCount;             // 本地变量数量
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;  // 作用域深度
+
+    int lastCallOffset;  // 最近一条OP_CALL在chunk里的偏移，没有则是-1。
+                         // returnStatement用它识别尾调用
+
+    ConstantMap constantMap;  // 本函数常量池的interning表
 } Compiler;
 
 // 当前正在编译的类
@@ -91,21 +107,23 @@ typedef struct ClassCompiler {
     bool hasSuperclass;  // 当前是否处在一个子类里
 } ClassCompiler;
 
-Parser parser;
+// 编译器状态和VM上下文一样按线程隔离（见vm.c的vmCurrent），
+// 每个线程跑自己的VM时interpret里的编译互不干扰
+_Thread_local Parser parser;
 
 // 当前Compiler对象引用
-Compiler* current = NULL;
+_Thread_local Compiler* current = NULL;
 
-ClassCompiler* currentClass = NULL;
+_Thread_local ClassCompiler* currentClass = NULL;
 
-// 当前是否在一个循环内
-bool inLoop = false;
+// 当前是否在一个循环内。循环状态同样是每个线程自己编译时的状态
+_Thread_local bool inLoop = false;
 // 循环中的break在chunk中的位置。可能有多个
-int breaks[UINT8_COUNT];
+_Thread_local int breaks[UINT8_COUNT];
 // break数量
-int breakCount = 0;
+_Thread_local int breakCount = 0;
 // 当前循环的开始指令位置
-int currentLoopStart = 0;
+_Thread_local int currentLoopStart = 0;
 
 // 获取当前的指令数组
 static Chunk* currentChunk() {
@@ -240,20 +258,156 @@ static void emitReturn() {
     emitByte(OP_RETURN);
 }
 
-// 值放入当前chunk的常量池，返回索引
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+// 常量池的硬上限：OP_CONSTANT_LONG的24位操作数
+#define CONSTANTS_MAX (1 << 24)
+
+// 常量池长过这个数才建interning表，小池子线性扫比建表开销小
+#define CONSTANT_MAP_MIN 16
+
+// 常量值的哈希。对象按指针（字符串已经全局interned，指针相等即值相等），
+// 数字按double的位模式
+static uint32_t constantHash(Value value) {
+    uint64_t bits;
+    if (IS_OBJ(value)) {
+        bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+    } else if (IS_NUMBER(value)) {
+        double num = AS_NUMBER(value);
+        memcpy(&bits, &num, sizeof(bits));
+    } else {
+        bits = IS_NIL(value) ? 1 : (AS_BOOL(value) ? 2 : 3);
+    }
+    return (uint32_t)((bits * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// 找常量在表里的槽位：要么存着同值常量，要么是第一个空槽
+static int constantMapSlot(ConstantMap* map, Value value) {
+    uint32_t index = constantHash(value) & (uint32_t)(map->capacity - 1);
+    for (;;) {
+        if (map->indexes[index] == -1 ||
+            valuesEqual(map->keys[index], value)) {
+            return (int)index;
+        }
+        index = (index + 1) & (uint32_t)(map->capacity - 1);
+    }
+}
+
+// 把常量记进表里，装到3/4满时翻倍重哈希
+static void constantMapPut(ConstantMap* map, Value value, int constant) {
+    if (map->count + 1 > map->capacity - map->capacity / 4) {
+        int oldCapacity = map->capacity;
+        Value* oldKeys = map->keys;
+        int* oldIndexes = map->indexes;
+
+        map->capacity = oldCapacity < 64 ? 64 : oldCapacity * 2;
+        map->keys = (Value*)malloc(sizeof(Value) * map->capacity);
+        map->indexes = (int*)malloc(sizeof(int) * map->capacity);
+        if (map->keys == NULL || map->indexes == NULL) {
+            exit(1);
+        }
+        for (int i = 0; i < map->capacity; i++) {
+            map->indexes[i] = -1;
+        }
+        for (int i = 0; i < oldCapacity; i++) {
+            if (oldIndexes[i] != -1) {
+                int slot = constantMapSlot(map, oldKeys[i]);
+                map->keys[slot] = oldKeys[i];
+                map->indexes[slot] = oldIndexes[i];
+            }
+        }
+        free(oldKeys);
+        free(oldIndexes);
+    }
+
+    int slot = constantMapSlot(map, value);
+    if (map->indexes[slot] == -1) {
+        map->keys[slot] = value;
+        map->indexes[slot] = constant;
+        map->count++;
+    }
+}
+
+/**
+ * @brief 值放入当前chunk的常量池，返回索引（可能超过255）。
+ * 相同的值复用同一个槽：字符串interning之后指针相等，
+ * 重复的标识符和字面量不再把常量池撑爆
+ *
+ * @param value 常量值
+ * @return int 常量索引
+ */
+static int internConstant(Value value) {
+    Chunk* chunk = currentChunk();
+    ConstantMap* map = &current->constantMap;
+
+    if (map->capacity == 0) {
+        // 池子还小，线性扫一遍就够了
+        for (int i = 0; i < chunk->constants.count; i++) {
+            if (valuesEqual(chunk->constants.values[i], value)) {
+                return i;
+            }
+        }
+        if (chunk->constants.count >= CONSTANT_MAP_MIN) {
+            // 线性扫开始不划算了，把已有常量灌进表，之后都走哈希查找。
+            // 大的生成模块常量能到几万甚至百万级，逐个扫是平方级开销
+            for (int i = 0; i < chunk->constants.count; i++) {
+                constantMapPut(map, chunk->constants.values[i], i);
+            }
+        }
+    } else {
+        int slot = constantMapSlot(map, value);
+        if (map->indexes[slot] != -1) {
+            return map->indexes[slot];
+        }
+    }
+
+    int constant = addConstant(chunk, value);
+    if (constant >= CONSTANTS_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
+    if (map->capacity > 0) {
+        constantMapPut(map, value, constant);
+    }
+    return constant;
+}
 
-    return (uint8_t)constant;
+// 发出一个24位大端的常量索引
+static void emitConstantIndex(int constant) {
+    emitByte((uint8_t)((constant >> 16) & 0xff));
+    emitByte((uint8_t)((constant >> 8) & 0xff));
+    emitByte((uint8_t)(constant & 0xff));
 }
 
-// 向chunk写入一个常量值的索引
+// 向chunk写入一个常量值的索引。索引放不进一个字节时用宽操作数指令
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    int constant = internConstant(value);
+    if (constant <= UINT8_MAX) {
+        emitBytes(OP_CONSTANT, (uint8_t)constant);
+    } else {
+        emitByte(OP_CONSTANT_LONG);
+        emitConstantIndex(constant);
+    }
+}
+
+// 按索引大小选择单字节还是24位操作数的指令。
+// 全局槽索引和名字常量索引都用它，超过255就换宽指令
+static void emitIndexed(uint8_t op, uint8_t longOp, int index) {
+    if (index <= UINT8_MAX) {
+        emitBytes(op, (uint8_t)index);
+    } else {
+        emitByte(longOp);
+        emitConstantIndex(index);
+    }
+}
+
+// 在当前chunk中开一个新的内联缓存槽，返回索引。
+// 槽索引用完（超过255个访问点）之后返回CACHE_NONE哨兵，
+// 之后的访问点不带缓存，退化成每次解析，但不影响编译
+static uint8_t makeCache() {
+    if (currentChunk()->cacheCount >= CACHE_NONE) {
+        return CACHE_NONE;
+    }
+
+    return (uint8_t)addCache(currentChunk());
 }
 
 // 设置之前的跳转占位符的步数
@@ -288,6 +442,11 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastCallOffset = -1;
+    compiler->constantMap.keys = NULL;
+    compiler->constantMap.indexes = NULL;
+    compiler->constantMap.count = 0;
+    compiler->constantMap.capacity = 0;
     compiler->function = newFunction();
     current = compiler;
 
@@ -295,6 +454,9 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
         // 当前函数名称，需要从源码字符串拷贝一下
         current->function->name =
             copyString(parser.previous.start, parser.previous.length);
+        // 和addConstant一样：编译中的函数可能已经晋升到老年代，
+        // 往里写年轻的名字字符串需要进记忆集
+        writeBarrier((Obj*)current->function);
     }
 
     // 当前compiler的第一个Local留给VM自己用
@@ -312,11 +474,157 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 }
 
 // 结束编译，返回函数对象
+// 指令在code数组中占的字节数（含操作数）
+static int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_CONSTANT_ADD:
+        case OP_BUILD_LIST:
+            return 2;
+        case OP_GET_PROPERTY:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_GET_LOCAL2:
+            return 3;
+        case OP_INVOKE:
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+            return 4;
+        case OP_GET_PROPERTY_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            return 5;
+        case OP_INVOKE_LONG:
+            return 6;
+        case OP_CLOSURE_LONG: {
+            int index = (chunk->code[offset + 1] << 16) |
+                        (chunk->code[offset + 2] << 8) |
+                        chunk->code[offset + 3];
+            ObjFunction* function =
+                AS_FUNCTION(chunk->constants.values[index]);
+            return 4 + function->upvalueCount * 2;
+        }
+        case OP_CLOSURE: {
+            // 长度取决于闭包变量数量，从常量池里的函数对象上拿
+            ObjFunction* function =
+                AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+/**
+ * @brief 窥孔优化。把高频的相邻指令对合并成超级指令，减少VM的分发次数。
+ * 合并保持指令总长度不变（省出来的字节用OP_NOP填充），
+ * 这样所有跳转偏移都不用重新计算。跳转目标位置上的指令不参与合并，
+ * 否则跳进来会落到半条指令中间。
+ *
+ * @param chunk 编译完成的chunk
+ */
+static void optimizeChunk(Chunk* chunk) {
+    if (chunk->count == 0) {
+        return;
+    }
+
+    // 先扫一遍标记所有跳转目标
+    bool* isTarget = (bool*)calloc(chunk->count, sizeof(bool));
+    if (isTarget == NULL) {
+        return;
+    }
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        uint8_t op = chunk->code[offset];
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE) {
+            int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            isTarget[offset + 3 + jump] = true;
+        } else if (op == OP_LOOP) {
+            int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            isTarget[offset + 3 - jump] = true;
+        }
+    }
+
+    // 再扫一遍做合并
+    for (int offset = 0; offset < chunk->count;) {
+        int next = offset + instructionLength(chunk, offset);
+        if (next >= chunk->count || isTarget[next]) {
+            offset = next;
+            continue;
+        }
+
+        uint8_t first = chunk->code[offset];
+        uint8_t second = chunk->code[next];
+        int after = next + instructionLength(chunk, next);
+
+        if (first == OP_GET_LOCAL && second == OP_GET_LOCAL) {
+            // 两个变量读取合成一条。第一个槽索引已经在offset+1上
+            chunk->code[offset] = OP_GET_LOCAL2;
+            chunk->code[offset + 2] = chunk->code[next + 1];
+            chunk->code[offset + 3] = OP_NOP;
+        } else if (first == OP_CONSTANT &&
+                   (second == OP_ADD || second == OP_ADD_NUMBER ||
+                    second == OP_ADD_STRING)) {
+            // OP_ADD_NUMBER/OP_ADD_STRING只在热函数再优化时出现：
+            // 量化之后编译期发不出的指令对也能合并了
+            chunk->code[offset] = OP_CONSTANT_ADD;
+            chunk->code[offset + 2] = OP_NOP;
+        } else if (second == OP_NOT &&
+                   (first == OP_EQUAL || first == OP_LESS ||
+                    first == OP_GREATER)) {
+            // 比较+取反合成一条。!= 是 EQUAL+NOT，>= 是 LESS+NOT，<= 是
+            // GREATER+NOT
+            chunk->code[offset] = first == OP_EQUAL     ? OP_NOT_EQUAL
+                                  : first == OP_LESS    ? OP_GREATER_EQUAL
+                                                        : OP_LESS_EQUAL;
+            chunk->code[offset + 1] = OP_NOP;
+        } else {
+            offset = next;
+            continue;
+        }
+        offset = after;
+    }
+
+    free(isTarget);
+}
+
+void optimizeFunction(ObjFunction* function) {
+    // 改写都是保长度的原地替换，函数已经在调用栈上也不影响挂起的ip
+    optimizeChunk(&function->chunk);
+}
+
 static ObjFunction* endCompiler() {
     // 所有函数后面都默认返回nil。如果前面的body里面已经有return,
     // 则会在执行中跳过默认的return nil
     emitReturn();
     ObjFunction* function = current->function;
+    // interning表只在编译期间有用，常量池本身跟着函数走
+    free(current->constantMap.keys);
+    free(current->constantMap.indexes);
+    // 编译完整个函数之后跑一遍窥孔优化
+    if (!parser.hadError) {
+        optimizeChunk(currentChunk());
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(), function->name != NULL
@@ -359,8 +667,23 @@ static void statement();
 static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
-static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+// 标识符进常量池。名字和字面量共用一个池，字面量多的chunk里
+// 名字索引照样会超过255，由发射方按大小选宽窄指令
+static int identifierConstant(Token* name) {
+    return internConstant(OBJ_VAL(copyString(name->start, name->length)));
+}
+
+// 解析全局变量的槽索引。名称interning之后交给VM统一分配，
+// 这样同一个全局变量在多次编译（REPL每行都是一次编译）里拿到的槽是稳定的。
+// 索引可能超过255，超出单字节操作数的部分走_LONG指令
+static int globalSlot(Token* name) {
+    int slot = vmGlobalSlot(copyString(name->start, name->length));
+    if (slot == -1) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
 }
 
 // 判断两个token是否同名
@@ -457,7 +780,7 @@ static void declareVariable() {
 }
 
 // 定义变量名称，把字符串名称放入常量池，后面只使用常量池索引
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
     // 变量声明，会将本地变量放入数组、校验是否有重名
     declareVariable();
@@ -466,7 +789,8 @@ static uint8_t parseVariable(const char* errorMessage) {
         return 0;
     }
 
-    return identifierConstant(&parser.previous);
+    // 全局变量在编译期直接解析成槽索引
+    return globalSlot(&parser.previous);
 }
 
 // 设置本地变量的深度
@@ -479,7 +803,7 @@ static void markInitialized() {
 }
 
 // 变量定义
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         // 本地变量的声明不往chunk里放任何值，它由变量的初始化表达式来直接表示。
         // 如 var a = 1 + 2; 执行到这个表达式的时候，栈顶就是 3
@@ -488,7 +812,7 @@ static void defineVariable(uint8_t global) {
         return;
     }
     // 定义为全局变量
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitIndexed(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 // 解析函数调用入参
@@ -572,30 +896,64 @@ static void binary(bool canAssign) {
 static void call(bool canAssign) {
     // 解析入参表达式
     uint8_t argCount = argumentList();
+    // 记下偏移，这条调用如果正好处在return的尾位置会被改写成尾调用
+    current->lastCallOffset = currentChunk()->count;
     // 增加一个函数调用指令和参数数量
     emitBytes(OP_CALL, argCount);
 }
 
+// 列表字面量 [a, b, c]。元素表达式依次入栈，最后一条指令收集
+static void listLiteral(bool canAssign) {
+    int count = 0;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression();
+            if (count == 255) {
+                error("Can't have more than 255 elements in a list literal.");
+            }
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emitBytes(OP_BUILD_LIST, (uint8_t)count);
+}
+
+// 下标存取 list[i] 和 list[i] = v
+static void subscript(bool canAssign) {
+    // 索引表达式
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        // 值表达式，之后栈上依次是列表、索引、值
+        expression();
+        emitByte(OP_SET_INDEX);
+    } else {
+        emitByte(OP_GET_INDEX);
+    }
+}
+
 // 点代表对象字段的获取或者赋值
 static void dot(bool canAssign) {
     // 后面跟字段名称
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     // 如果有等号且可以赋值，说明是字段赋值
     if (canAssign && match(TOKEN_EQUAL)) {
         // 解析值表达式
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitIndexed(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
     } else if (match(TOKEN_LEFT_PAREN)) {
         // 如果点后面的indetifer带括号,是方法调用
         uint8_t argCount = argumentList();
-        // 方法调用
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+        // 方法调用。每个调用点带一个自己的内联缓存槽
+        emitIndexed(OP_INVOKE, OP_INVOKE_LONG, name);
+        emitBytes(argCount, makeCache());
     } else {
-        // 后面什么都不带，是字段获取
-        emitBytes(OP_GET_PROPERTY, name);
+        // 后面什么都不带，是字段获取。每个访问点带一个自己的内联缓存槽
+        emitIndexed(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+        emitByte(makeCache());
     }
 }
 
@@ -680,8 +1038,8 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        // 全局变量，arg是变量在常量池中的索引，运行时需要先获取变量名称，然后去全局变量哈希表中查找值
-        arg = identifierConstant(&name);
+        // 全局变量，arg是编译期解析好的全局槽索引，运行时直接按索引存取
+        arg = globalSlot(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
@@ -689,10 +1047,19 @@ static void namedVariable(Token name, bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         // 如果可以赋值且后面跟等号，则需要解析后面变量值的表达式，然后放一个OP_SET指令
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        if (setOp == OP_SET_GLOBAL) {
+            // 全局槽索引可能超过255，必要时用24位操作数
+            emitIndexed(OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, arg);
+        } else {
+            emitBytes(setOp, (uint8_t)arg);
+        }
     } else {
         // 不然就是一个变量获取
-        emitBytes(getOp, (uint8_t)arg);
+        if (getOp == OP_GET_GLOBAL) {
+            emitIndexed(OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, arg);
+        } else {
+            emitBytes(getOp, (uint8_t)arg);
+        }
     }
 }
 
@@ -722,7 +1089,7 @@ static void super_(bool canAssign) {
     // 后面跟 方法名
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
     // 解析方法名
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     // 获取this关键字对应的实例，因为super.method()，是用子类的实例调用父类的方法体，this代表了之类实例
     namedVariable(syntheticToken("this"), false);
@@ -734,12 +1101,12 @@ static void super_(bool canAssign) {
         // 父类对象
         namedVariable(syntheticToken("super"), false);
         // 父类方法调用指令
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitIndexed(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
         emitByte(argCount);
     } else {
         // 没跟括号的话，是一个父类方法的获取
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitIndexed(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
@@ -779,6 +1146,8 @@ ParseRule rules[] = {
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
     [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {listLiteral, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
@@ -892,7 +1261,7 @@ static void function(FunctionType type) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
             // 解析一个入参，声明为本地变量。（函数的入参就是函数方法体内的本地变量）
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -904,7 +1273,13 @@ static void function(FunctionType type) {
     // 返回函数对象
     ObjFunction* function = endCompiler();
     // 函数对象放入常量池。每个函数都被包装成一个闭包函数
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    int constant = internConstant(OBJ_VAL(function));
+    if (constant <= UINT8_MAX) {
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
+    } else {
+        emitByte(OP_CLOSURE_LONG);
+        emitConstantIndex(constant);
+    }
 
     // 后面跟闭包变量
     for (int i = 0; i < function->upvalueCount; i++) {
@@ -918,7 +1293,7 @@ static void function(FunctionType type) {
 // 解析类方法
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
 
     FunctionType type = TYPE_METHOD;
 
@@ -931,19 +1306,20 @@ static void method() {
     // 按函数来解析方法体
     function(type);
     // 方法指令，会把函数包装成方法
-    emitBytes(OP_METHOD, constant);
+    emitIndexed(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 // 类声明
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    // OP_CLASS的操作数仍然是类名在常量池里的索引
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
-    // 类相当于全局变量
-    defineVariable(nameConstant);
+    emitIndexed(OP_CLASS, OP_CLASS_LONG, nameConstant);
+    // 类相当于全局变量，占一个全局槽（在block里声明时是本地变量，槽索引不会被用到）
+    defineVariable(current->scopeDepth > 0 ? 0 : globalSlot(&className));
 
     // 表明当前处于类中
     ClassCompiler classCompiler;
@@ -995,7 +1371,7 @@ static void classDeclaration() {
 // 函数声明
 static void funDeclaration() {
     // 函数名称
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
     // 创建函数对象
     function(TYPE_FUNCTION);
@@ -1006,7 +1382,7 @@ static void funDeclaration() {
 // 变量定义
 static void varDeclaration() {
     // 获取变量名的常量池索引
-    uint8_t name = parseVariable("Expect variable name.");
+    int name = parseVariable("Expect variable name.");
 
     // 后面有等于号，变量有初始化值，否则是空。先把变量值放入栈中
     if (match(TOKEN_EQUAL)) {
@@ -1165,6 +1541,13 @@ static void returnStatement() {
         // 解析返回表达式，然后返回
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // 返回表达式以一条函数调用收尾的话就是尾调用，改写成OP_TAIL_CALL
+        // 让VM复用当前帧。指令长度不变，OP_RETURN留着给回退路径用
+        Chunk* chunk = currentChunk();
+        if (current->lastCallOffset >= 0 &&
+            current->lastCallOffset == chunk->count - 2) {
+            chunk->code[current->lastCallOffset] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
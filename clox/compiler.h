@@ -8,6 +8,16 @@
 // 最外层的脚本代码也认为是一个函数，没有入参也没有返回值。执行的时候统一当做函数来执行
 ObjFunction* compile(const char* source);
 
+/**
+ * @brief 对热函数再跑一轮窥孔优化。
+ * 运行时量化（quickening）会把通用算术指令改写成专用版本，
+ * 在那之后再扫一遍能合并出编译期看不到的指令对。
+ * VM在函数调用次数达到阈值时调用。
+ *
+ * @param function 热函数
+ */
+void optimizeFunction(ObjFunction* function);
+
 void markCompilerRoots();
 
 #endif
\ No newline at end of file
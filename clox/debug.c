@@ -69,12 +69,59 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
+    uint8_t cache = chunk->code[offset + 3];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    printf("' cache %d\n", cache);
+    return offset + 4;
+}
+
+// 打印带内联缓存槽的属性指令
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t cache = chunk->code[offset + 2];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
     return offset + 3;
 }
 
+// 从code里读24位大端常量索引
+static int longIndex(Chunk* chunk, int offset) {
+    return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) |
+           chunk->code[offset + 2];
+}
+
+// 打印宽版常量指令（24位常量索引）
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+    int constant = longIndex(chunk, offset + 1);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+// 打印宽版的带内联缓存槽的属性指令
+static int propertyLongInstruction(const char* name, Chunk* chunk, int offset) {
+    int constant = longIndex(chunk, offset + 1);
+    uint8_t cache = chunk->code[offset + 4];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 5;
+}
+
+// 打印宽版方法调用指令
+static int invokeLongInstruction(const char* name, Chunk* chunk, int offset) {
+    int constant = longIndex(chunk, offset + 1);
+    uint8_t argCount = chunk->code[offset + 4];
+    uint8_t cache = chunk->code[offset + 5];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 6;
+}
+
 /**
  * @brief 打印指令
  *
@@ -85,12 +132,12 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    if (offset > 0 && getLine(chunk, offset) == getLine(chunk, offset - 1)) {
         // 如果这个指令和上个指令行数一样，行数省略成 |
         printf("   | ");
     } else {
         // 打印行数
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", getLine(chunk, offset));
     }
 
     // 从code中从获取指令，根据不同的指令执行不同的打印函数
@@ -111,17 +158,17 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return byteInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return byteInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return byteInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
             return constantInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
@@ -184,8 +231,165 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return constantInstruction("OP_METHOD", chunk, offset);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
+        case OP_SUPER_INVOKE: {
+            uint8_t constant = chunk->code[offset + 1];
+            uint8_t argCount = chunk->code[offset + 2];
+            printf("%-16s (%d args) %4d '", "OP_SUPER_INVOKE", argCount,
+                   constant);
+            printValue(chunk->constants.values[constant]);
+            printf("'\n");
+            return offset + 3;
+        }
+        case OP_NOP:
+            return simpleInstruction("OP_NOP", offset);
+        case OP_GET_LOCAL2: {
+            uint8_t slotA = chunk->code[offset + 1];
+            uint8_t slotB = chunk->code[offset + 2];
+            printf("%-16s %4d %4d\n", "OP_GET_LOCAL2", slotA, slotB);
+            return offset + 3;
+        }
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_CONSTANT_ADD:
+            return constantInstruction("OP_CONSTANT_ADD", chunk, offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_ADD_STRING:
+            return simpleInstruction("OP_ADD_STRING", offset);
+        case OP_SUBTRACT_NUMBER:
+            return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+        case OP_MULTIPLY_NUMBER:
+            return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+        case OP_DIVIDE_NUMBER:
+            return simpleInstruction("OP_DIVIDE_NUMBER", offset);
+        case OP_CONSTANT_LONG: {
+            int constant = (chunk->code[offset + 1] << 16) |
+                           (chunk->code[offset + 2] << 8) |
+                           chunk->code[offset + 3];
+            printf("%-16s %4d '", "OP_CONSTANT_LONG", constant);
+            printValue(chunk->constants.values[constant]);
+            printf("'\n");
+            return offset + 4;
+        }
+        case OP_GET_GLOBAL_LONG: {
+            int slot = (chunk->code[offset + 1] << 16) |
+                       (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+            printf("%-16s %4d\n", "OP_GET_GLOBAL_LONG", slot);
+            return offset + 4;
+        }
+        case OP_DEFINE_GLOBAL_LONG: {
+            int slot = (chunk->code[offset + 1] << 16) |
+                       (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+            printf("%-16s %4d\n", "OP_DEFINE_GLOBAL_LONG", slot);
+            return offset + 4;
+        }
+        case OP_SET_GLOBAL_LONG: {
+            int slot = (chunk->code[offset + 1] << 16) |
+                       (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+            printf("%-16s %4d\n", "OP_SET_GLOBAL_LONG", slot);
+            return offset + 4;
+        }
+        case OP_GET_PROPERTY_LONG:
+            return propertyLongInstruction("OP_GET_PROPERTY_LONG", chunk,
+                                           offset);
+        case OP_SET_PROPERTY_LONG:
+            return constantLongInstruction("OP_SET_PROPERTY_LONG", chunk,
+                                           offset);
+        case OP_INVOKE_LONG:
+            return invokeLongInstruction("OP_INVOKE_LONG", chunk, offset);
+        case OP_GET_SUPER_LONG:
+            return constantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
+        case OP_SUPER_INVOKE_LONG: {
+            int constant = longIndex(chunk, offset + 1);
+            uint8_t argCount = chunk->code[offset + 4];
+            printf("%-16s (%d args) %4d '", "OP_SUPER_INVOKE_LONG", argCount,
+                   constant);
+            printValue(chunk->constants.values[constant]);
+            printf("'\n");
+            return offset + 5;
+        }
+        case OP_CLASS_LONG:
+            return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
+        case OP_METHOD_LONG:
+            return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
+        case OP_CLOSURE_LONG: {
+            int constant = (chunk->code[offset + 1] << 16) |
+                           (chunk->code[offset + 2] << 8) |
+                           chunk->code[offset + 3];
+            printf("%-16s %4d ", "OP_CLOSURE_LONG", constant);
+            printValue(chunk->constants.values[constant]);
+            printf("\n");
+            offset += 4;
+
+            ObjFunction* function =
+                AS_FUNCTION(chunk->constants.values[constant]);
+            for (int j = 0; j < function->upvalueCount; j++) {
+                int isLocal = chunk->code[offset++];
+                int index = chunk->code[offset++];
+                printf("%04d      |                     %s %d\n", offset - 2,
+                       isLocal ? "local" : "upvalue", index);
+            }
+            return offset;
+        }
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_GET_INDEX:
+            return simpleInstruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simpleInstruction("OP_SET_INDEX", offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
-}
\ No newline at end of file
+}
+// opcode名字表。用#op自动展开名字字符串，按opcode值索引
+static const char* opcodeNames[] = {
+#define NAME(op) [op] = #op
+    NAME(OP_CONSTANT),        NAME(OP_NIL),
+    NAME(OP_TRUE),            NAME(OP_FALSE),
+    NAME(OP_POP),             NAME(OP_GET_LOCAL),
+    NAME(OP_SET_LOCAL),       NAME(OP_GET_GLOBAL),
+    NAME(OP_DEFINE_GLOBAL),   NAME(OP_SET_GLOBAL),
+    NAME(OP_GET_UPVALUE),     NAME(OP_SET_UPVALUE),
+    NAME(OP_GET_PROPERTY),    NAME(OP_SET_PROPERTY),
+    NAME(OP_EQUAL),           NAME(OP_GET_SUPER),
+    NAME(OP_GREATER),         NAME(OP_LESS),
+    NAME(OP_ADD),             NAME(OP_SUBTRACT),
+    NAME(OP_MULTIPLY),        NAME(OP_DIVIDE),
+    NAME(OP_NOT),             NAME(OP_NEGATE),
+    NAME(OP_PRINT),           NAME(OP_JUMP),
+    NAME(OP_JUMP_IF_FALSE),   NAME(OP_LOOP),
+    NAME(OP_CALL),            NAME(OP_INVOKE),
+    NAME(OP_SUPER_INVOKE),    NAME(OP_CLOSURE),
+    NAME(OP_CLOSE_UPVALUE),   NAME(OP_RETURN),
+    NAME(OP_CLASS),           NAME(OP_INHERIT),
+    NAME(OP_METHOD),          NAME(OP_NOP),
+    NAME(OP_GET_LOCAL2),      NAME(OP_NOT_EQUAL),
+    NAME(OP_GREATER_EQUAL),   NAME(OP_LESS_EQUAL),
+    NAME(OP_CONSTANT_ADD),    NAME(OP_ADD_NUMBER),
+    NAME(OP_ADD_STRING),      NAME(OP_SUBTRACT_NUMBER),
+    NAME(OP_MULTIPLY_NUMBER), NAME(OP_DIVIDE_NUMBER),
+    NAME(OP_CONSTANT_LONG),   NAME(OP_CLOSURE_LONG),
+    NAME(OP_BUILD_LIST),      NAME(OP_GET_INDEX),
+    NAME(OP_SET_INDEX),       NAME(OP_TAIL_CALL),
+    NAME(OP_GET_GLOBAL_LONG), NAME(OP_DEFINE_GLOBAL_LONG),
+    NAME(OP_SET_GLOBAL_LONG), NAME(OP_GET_PROPERTY_LONG),
+    NAME(OP_SET_PROPERTY_LONG), NAME(OP_INVOKE_LONG),
+    NAME(OP_GET_SUPER_LONG),  NAME(OP_SUPER_INVOKE_LONG),
+    NAME(OP_CLASS_LONG),      NAME(OP_METHOD_LONG),
+#undef NAME
+};
+
+const char* opcodeName(uint8_t opcode) {
+    if (opcode < sizeof(opcodeNames) / sizeof(opcodeNames[0]) &&
+        opcodeNames[opcode] != NULL) {
+        return opcodeNames[opcode];
+    }
+    return "OP_UNKNOWN";
+}
@@ -6,4 +6,12 @@
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
+/**
+ * @brief opcode对应的名字，profiler的直方图输出用
+ *
+ * @param opcode
+ * @return const char*
+ */
+const char* opcodeName(uint8_t opcode);
+
 #endif
\ No newline at end of file
@@ -1,14 +1,25 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "profiler.h"
+#include "serialize.h"
 #include "vm.h"
 
+// 进程主VM上下文。嵌入方可以在不同线程上各建一个，这里命令行只用一个
+static VM mainVM;
+
 /**
  * @brief 执行交互式命令行
- * 
+ *
  */
 static void repl() {
     char line[1024];
@@ -20,7 +31,7 @@ static void repl() {
             break;
         }
         // 每次读取一行，解释执行
-        interpret(line);
+        interpret(&mainVM, line);
     }
 }
 
@@ -60,14 +71,71 @@ static char* readFile(const char* path) {
 }
 
 /**
- * @brief 执行指定路径上的源代码文件
- * 
- * @param path 
+ * @brief mmap方式映射源码文件。内核按需换页、随时可回收，
+ * 几十MB的脚本不用再在堆上整份常驻一个拷贝。
+ * scanner要求NUL结尾：文件大小不是页大小整数倍时，最后一页
+ * 自动补零正好当结束符；恰好是整数倍的少数情况返回NULL，
+ * 调用方退回堆读取
+ *
+ * @param path 源码路径
+ * @param mappedSize 出参，munmap时用
+ * @return char* 映射好的源码，失败返回NULL
+ */
+static char* mapFile(const char* path, size_t* mappedSize) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+        st.st_size % sysconf(_SC_PAGESIZE) == 0) {
+        close(fd);
+        return NULL;
+    }
+    void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return NULL;
+    }
+    *mappedSize = (size_t)st.st_size;
+    return (char*)mapped;
+}
+
+/**
+ * @brief 执行指定路径上的源代码文件。
+ * 如果文件是编译好的字节码容器，直接mmap加载执行，跳过scanner和compiler
+ *
+ * @param path
  */
 static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    InterpretResult result;
+    if (isHeapImageFile(path)) {
+        // 镜像路径：直接恢复快照时的全局状态，prelude的编译和执行都跳过
+        if (!loadImage(path)) {
+            exit(65);
+        }
+        return;
+    }
+    if (isBytecodeFile(path)) {
+        // 热启动路径：加载编译产物直接执行
+        ObjFunction* function = loadBytecode(path);
+        if (function == NULL) {
+            exit(65);
+        }
+        result = interpretFunction(&mainVM, function);
+    } else {
+        // 源码和字节码一个待遇：优先mmap，省掉整份堆拷贝
+        size_t mappedSize = 0;
+        char* mapped = mapFile(path, &mappedSize);
+        if (mapped != NULL) {
+            result = interpret(&mainVM, mapped);
+            munmap(mapped, mappedSize);
+        } else {
+            char* source = readFile(path);
+            result = interpret(&mainVM, source);
+            free(source);
+        }
+    }
 
     if (result == INTERPRET_COMPILE_ERROR)
         exit(65);
@@ -76,23 +144,80 @@ static void runFile(const char* path) {
 }
 
 /**
- * @brief 
+ * @brief 只编译不执行，把编译产物写入字节码容器文件
  * 
+ * @param path 源码路径
+ * @param outPath 输出路径
+ */
+static void compileFile(const char* path, const char* outPath) {
+    char* source = readFile(path);
+    ObjFunction* function = compile(source);
+    free(source);
+    if (function == NULL) {
+        exit(65);
+    }
+    if (!saveBytecode(function, outPath)) {
+        exit(74);
+    }
+}
+
+/**
+ * @brief 跑完prelude脚本后把活堆快照成镜像文件
+ *
+ * @param path prelude脚本路径
+ * @param outPath 镜像输出路径
+ */
+static void snapshotFile(const char* path, const char* outPath) {
+    // 编译或运行出错时runFile里已经exit了
+    runFile(path);
+    if (!saveImage(outPath)) {
+        exit(74);
+    }
+}
+
+/**
+ * @brief
+ *
  * @param argc  argc至少会等于1，argv[0]是可执行文件名称，后面才是用户传入的参数
- * @param argv 
- * @return int 
+ * @param argv
+ * @return int
  */
 int main(int argc, const char* argv[]) {
-    initVM();
+    initVM(&mainVM);
 
     if (argc == 1) {
         repl();
     } else if (argc == 2) {
         runFile(argv[1]);
+    } else if (argc == 3 && strcmp(argv[1], "--profile") == 0) {
+        // clox --profile script.lox  采样profile，退出前输出报告
+        profilerStart();
+        runFile(argv[2]);
+        profilerReport();
+    } else if (argc == 3 && strcmp(argv[1], "--gc-stats") == 0) {
+        // clox --gc-stats script.lox  跑完后输出GC统计汇总
+        runFile(argv[2]);
+        printGCStats();
+    } else if (argc == 4 && strcmp(argv[1], "-c") == 0) {
+        // clox -c script.lox out.clxb  只编译，产物给后续的进程热启动用
+        compileFile(argv[2], argv[3]);
+    } else if (argc == 4 && strcmp(argv[1], "-s") == 0) {
+        // clox -s prelude.lox out.clxi  跑完prelude后快照活堆
+        snapshotFile(argv[2], argv[3]);
+    } else if (argc == 4 && strcmp(argv[1], "--boot") == 0) {
+        // clox --boot image.clxi script.lox  从镜像恢复VM再跑脚本，
+        // prelude建好的类、闭包、配置数据直接可用
+        if (!loadImage(argv[2])) {
+            exit(65);
+        }
+        runFile(argv[3]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr,
+                "Usage: clox [path] | clox --profile <path> | clox --gc-stats "
+                "<path> | clox -c <path> <output> | clox -s <path> <image> | "
+                "clox --boot <image> <path>\n");
         exit(64);
     }
-    freeVM();
+    freeVM(&mainVM);
     return 0;
 }
@@ -1,16 +1,106 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-// 每次GC之后，下载GC阈值为当前的两倍
-#define GC_HEAP_GROW_FACTOR 2
+// major GC之后，下次major GC的阈值为当前堆大小的四倍
+#define GC_MAJOR_GROW_FACTOR 4
+
+// 并行标记最多用几个worker线程（含发起GC的线程自己）
+#define GC_MARK_WORKERS 4
+
+// grayStack里至少积累这么多对象才值得并行。小堆起线程比直接标完还慢
+#define GC_PARALLEL_THRESHOLD 256
+
+// 保护grayStack和busyWorkers。锁可以整个进程共用，
+// 但「是否在并行trace」和busyWorkers本身是每个VM自己的状态（见vm.h），
+// 不然一个线程的VM收完尾会把别的线程的VM从带锁模式里踢出去
+static pthread_mutex_t grayMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ---------------- 小对象内存池 ----------------
+// ObjString、ObjUpvalue、ObjInstance、ObjClosure这类小对象分配和回收非常频繁，
+// 每次都走系统realloc/free既慢又把对象打散在堆里。这里按大小分档做内存池：
+// 不超过POOL_MAX_SIZE的块从池里拿，回收时挂回对应档的空闲链表而不是free。
+// 同一个slab里的对象地址连续，GC遍历链表时局部性也更好。
+
+// 走内存池的最大块大小。常用的Obj结构都在这个范围内
+#define POOL_MAX_SIZE 128
+// 每个slab一次性向系统申请的字节数，再切成等大的块
+#define POOL_SLAB_SIZE 4096
+
+// 空闲块。复用块本身的内存存next指针，不占额外空间
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+} FreeBlock;
+
+// slab头。块数据紧跟在头后面，头串成链表方便退出时统一归还
+typedef struct Slab {
+    struct Slab* next;
+} Slab;
+
+// 空闲链表和slab链表挂在当前VM上下文里（vm.poolFree/vm.poolSlabs），
+// 这样每个VM有自己的内存池，多个VM并行跑在不同线程上也不会互相碰
+
+// 块大小对应的档位索引
+static int poolClass(size_t size) {
+    if (size <= 16)
+        return 0;
+    if (size <= 32)
+        return 1;
+    if (size <= 64)
+        return 2;
+    return 3;
+}
+
+// 档位对应的块大小
+static size_t poolClassSize(int cls) {
+    return (size_t)16 << cls;
+}
+
+// 从池里取一个能放下size字节的块
+static void* poolAlloc(size_t size) {
+    int cls = poolClass(size);
+    if (vm.poolFree[cls] == NULL) {
+        // 该档空闲链表空了，申请一块新slab切成等大的块串起来
+        Slab* slab = (Slab*)malloc(sizeof(Slab) + POOL_SLAB_SIZE);
+        if (slab == NULL)
+            exit(1);
+        slab->next = (Slab*)vm.poolSlabs;
+        vm.poolSlabs = slab;
+
+        uint8_t* start = (uint8_t*)(slab + 1);
+        size_t blockSize = poolClassSize(cls);
+        for (size_t offset = 0; offset + blockSize <= POOL_SLAB_SIZE;
+             offset += blockSize) {
+            FreeBlock* block = (FreeBlock*)(start + offset);
+            block->next = (FreeBlock*)vm.poolFree[cls];
+            vm.poolFree[cls] = block;
+        }
+    }
+
+    FreeBlock* block = (FreeBlock*)vm.poolFree[cls];
+    vm.poolFree[cls] = block->next;
+    return block;
+}
+
+// 把块挂回对应档的空闲链表
+static void poolFreeBlock(void* pointer, size_t size) {
+    int cls = poolClass(size);
+    FreeBlock* block = (FreeBlock*)pointer;
+    block->next = (FreeBlock*)vm.poolFree[cls];
+    vm.poolFree[cls] = block;
+}
 
 /**
  * @brief 对一个数组（指针）进行扩容
@@ -24,23 +114,58 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     // 更新全局对象大小
     vm.bytesAllocated += newSize - oldSize;
 
+    // 只有内存增长才可能触发GC。回收路径上的释放（sweep里的freeObject）
+    // 也会走到这里，在这儿再触发GC会递归回收
     if (newSize > oldSize) {
+        if (vm.bytesAllocated > vm.gcStats.peakBytes) {
+            vm.gcStats.peakBytes = vm.bytesAllocated;
+        }
 #ifdef DEBUG_STRESS_GC
         collectGarbage();
 #endif
-    }
 
-    // 如果达到了GC触发条件
-    if (vm.bytesAllocated > vm.nextGC) {
-        collectGarbage();
+        // 如果达到了GC触发条件
+        if (vm.bytesAllocated > vm.nextGC) {
+            collectGarbage();
+        }
     }
 
+    // 不变量：所有正确传了oldSize、且大小不超过POOL_MAX_SIZE的活跃块都来自内存池
+    bool oldPooled = pointer != NULL && oldSize > 0 && oldSize <= POOL_MAX_SIZE;
+    bool newPooled = newSize > 0 && newSize <= POOL_MAX_SIZE;
+
     // 如果新长度是0，代表需要回收
     if (newSize == 0) {
-        free(pointer);
+        if (oldPooled) {
+            poolFreeBlock(pointer, oldSize);
+        } else {
+            free(pointer);
+        }
         return NULL;
     }
-    // 重新申请空间
+
+    // 新旧大小落在同一档，原来的块就够用
+    if (oldPooled && newPooled && poolClass(oldSize) == poolClass(newSize)) {
+        return pointer;
+    }
+
+    // 有一边在池里：申请新块，把旧数据拷过去，旧块按来源归还
+    if (oldPooled || newPooled) {
+        void* result = newPooled ? poolAlloc(newSize) : malloc(newSize);
+        if (result == NULL)
+            exit(1);
+        if (pointer != NULL) {
+            memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+            if (oldPooled) {
+                poolFreeBlock(pointer, oldSize);
+            } else {
+                free(pointer);
+            }
+        }
+        return result;
+    }
+
+    // 两边都是大块，还是交给系统realloc
     void* result = realloc(pointer, newSize);
     if (result == NULL)
         exit(1);
@@ -52,8 +177,16 @@ void markObject(Obj* object) {
         return;
     }
 
-    if (object->isMarked) {
-        // 如果已经被标记个了，说明是循环引用，不继续处理。
+    // minor GC只回收年轻代，老年代对象默认存活，不标记也不继续遍历。
+    // 老年代指向年轻代的引用由记忆集负责补扫。
+    if (vm.gcMinor && object->isOld) {
+        return;
+    }
+
+    // 原子地test-and-set标记位。并行trace时多个worker可能同时走到
+    // 同一个对象，只有抢到的那个负责把它放进grayStack；
+    // 已经置位说明被别人标过（或循环引用），不继续处理
+    if (__atomic_exchange_n(&object->isMarked, true, __ATOMIC_ACQ_REL)) {
         return;
     }
 
@@ -62,7 +195,9 @@ void markObject(Obj* object) {
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
-    object->isMarked = true;
+    if (vm.parallelMarking) {
+        pthread_mutex_lock(&grayMutex);
+    }
     // 动态扩容grayStack数组
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -75,7 +210,9 @@ void markObject(Obj* object) {
     // 放入遍历中的对象数组
     vm.grayStack[vm.grayCount++] = object;
 
-    
+    if (vm.parallelMarking) {
+        pthread_mutex_unlock(&grayMutex);
+    }
 }
 
 void markValue(Value value) {
@@ -89,6 +226,25 @@ static void markArray(ValueArray* array) {
     }
 }
 
+void writeBarrier(Obj* object) {
+    // 年轻代对象本来就会被minor GC完整扫描，不用记录
+    if (object == NULL || !object->isOld || object->isRemembered) {
+        return;
+    }
+
+    object->isRemembered = true;
+    // 动态扩容记忆集数组。和grayStack一样不走reallocate，避免在GC路径上再触发GC
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered =
+            (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+        if (vm.remembered == NULL)
+            exit(1);
+    }
+
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
 // GC遍历对象的引用
 static void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
@@ -103,10 +259,24 @@ static void blackenObject(Obj* object) {
             markObject((Obj*)bound->method);
             break;
         }
+        case OBJ_CHANNEL: {
+            ObjChannel* channel = (ObjChannel*)object;
+            // 队列里还没被接收的值
+            for (int i = channel->head; i < channel->queue.count; i++) {
+                markValue(channel->queue.values[i]);
+            }
+            // 等待接收的fiber（链表后面的节点由fiber自己的next标记）
+            markObject((Obj*)channel->waiting);
+            break;
+        }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
+            // vtable的内容是methods表的子集，为稳妥还是单独标一遍
+            for (int i = 0; i < klass->vtableCapacity; i++) {
+                markValue(klass->vtable[i]);
+            }
             break;
         }
         case OBJ_CLOSURE: {
@@ -119,11 +289,31 @@ static void blackenObject(Obj* object) {
             }
             break;
         }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            // fiber自己的栈和帧就是一组根：活跃栈值、打开的upvalue、帧上的闭包。
+            // 当前fiber的stackTop/frameCount在GC开始时已经同步过了
+            for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+                markValue(*slot);
+                markObject((Obj*)fiber->openUpvalueSlots[slot - fiber->stack]);
+            }
+            for (int i = 0; i < fiber->frameCount; i++) {
+                markObject((Obj*)fiber->frames[i].closure);
+            }
+            // 队列里排在后面的fiber
+            markObject((Obj*)fiber->next);
+            break;
+        }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             // 分别标记函数名称和常量池里的对象
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            // 内联缓存里记住的类和方法也是引用，不标记的话缓存会指向已回收的对象
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                markObject((Obj*)function->chunk.caches[i].klass);
+                markValue(function->chunk.caches[i].method);
+            }
             break;
         }
         case OBJ_INSTANCE: {
@@ -132,6 +322,18 @@ static void blackenObject(Obj* object) {
             markTable(&instance->fields);
             break;
         }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            markArray(&list->items);
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markValue(rope->left);
+            markValue(rope->right);
+            markObject((Obj*)rope->flattened);
+            break;
+        }
         case OBJ_UPVALUE:
             // closed字段引用了变量值
             markValue(((ObjUpvalue*)object)->closed);
@@ -155,15 +357,30 @@ static void freeObject(Obj* object) {
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
             freeTable(&klass->methods);
+            FREE_ARRAY(Value, klass->vtable, klass->vtableCapacity);
             FREE(ObjClass, object);
             break;
         }
+        case OBJ_CHANNEL: {
+            ObjChannel* channel = (ObjChannel*)object;
+            freeValueArray(&channel->queue);
+            FREE(ObjChannel, object);
+            break;
+        }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
             FREE(ObjClosure, object);
             break;
         }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            FREE_ARRAY(Value, fiber->stack, STACK_MAX);
+            FREE_ARRAY(CallFrame, fiber->frames, FRAMES_MAX);
+            FREE_ARRAY(ObjUpvalue*, fiber->openUpvalueSlots, STACK_MAX);
+            FREE(ObjFiber, object);
+            break;
+        }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
@@ -176,16 +393,23 @@ static void freeObject(Obj* object) {
             FREE(ObjInstance, object);
             break;
         }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            freeValueArray(&list->items);
+            FREE(ObjList, object);
+            break;
+        }
         case OBJ_NATIVE:
             FREE(ObjNative, object);
             break;
+        case OBJ_ROPE:
+            FREE(ObjRope, object);
+            break;
         case OBJ_STRING: {
             //直接转成ObjString类型
             ObjString* string = (ObjString*)object;
-            // 释放字符串所在的heap空间
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            // 释放对象本身
-            FREE(ObjString, object);
+            // 字符内联在对象尾部，对象和字符一起释放。大小必须和分配时一致
+            reallocate(object, sizeof(ObjString) + string->length + 1, 0);
             break;
         }
         case OBJ_UPVALUE:
@@ -196,24 +420,23 @@ static void freeObject(Obj* object) {
 
 // 标记存活对象
 static void markRoots() {
-    // 将执行当中的栈中的值依次标记
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-        markValue(*slot);
+    // 当前fiber运行期间栈顶和帧数以vm里的为准，先同步回fiber对象，
+    // 再把fiber当作根标记。栈、帧、打开的upvalue都在blackenObject里遍历
+    if (vm.fiber != NULL) {
+        vm.fiber->stackTop = vm.stackTop;
+        vm.fiber->frameCount = vm.frameCount;
     }
+    markObject((Obj*)vm.fiber);
 
-    // vm当前的frames帧栈里存的closure对象也需要标记
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj*)vm.frames[i].closure);
-    }
+    // 运行队列里排队的fiber（队列后面的节点由fiber的next接力标记）
+    markObject((Obj*)vm.runHead);
 
-    // vm当前保存的闭包变量
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
-         upvalue = upvalue->next) {
-        markObject((Obj*)upvalue);
+    // 全局变量槽和名字->槽索引表
+    for (int i = 0; i < vm.globalCount; i++) {
+        markObject((Obj*)vm.globals[i].name);
+        markValue(vm.globals[i].value);
     }
-
-    // 全局变量
-    markTable(&vm.globals);
+    markTable(&vm.globalNames);
 
     // 编译阶段也可能触发GC，标记编译过程中的对象
     markCompilerRoots();
@@ -221,19 +444,98 @@ static void markRoots() {
     markObject((Obj*)vm.initString);
 }
 
-// GC标记间接引用的对象
+// 并行标记的worker：不断从grayStack领对象blacken，直到栈空且没有
+// 同伴还在干活（在干活的随时可能push出新的灰对象）
+static void* markWorker(void* arg) {
+    // GC代码全部通过线程局部的vm宏访问上下文，worker先绑定到
+    // 发起这轮GC的VM上
+    vmCurrent = (VM*)arg;
+    for (;;) {
+        pthread_mutex_lock(&grayMutex);
+        if (vm.grayCount == 0) {
+            bool done = vm.busyWorkers == 0;
+            pthread_mutex_unlock(&grayMutex);
+            if (done) {
+                return NULL;
+            }
+            sched_yield();
+            continue;
+        }
+        Obj* object = vm.grayStack[--vm.grayCount];
+        vm.busyWorkers++;
+        pthread_mutex_unlock(&grayMutex);
+
+        blackenObject(object);
+
+        pthread_mutex_lock(&grayMutex);
+        vm.busyWorkers--;
+        pthread_mutex_unlock(&grayMutex);
+    }
+}
+
+// GC标记间接引用的对象。worklist大的时候多线程分摊，
+// trace是停顿里占大头的阶段，基本随worker数线性缩短
 static void traceReferences() {
-    while (vm.grayCount > 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores < GC_MARK_WORKERS ? (int)cores : GC_MARK_WORKERS;
+
+    // 先单线程标。根对象通常没几个，worklist是blacken大容器
+    // （列表、表、fiber栈）时才膨胀起来，膨胀了再升级成并行
+    while (vm.grayCount > 0 &&
+           (workers < 2 || vm.grayCount < GC_PARALLEL_THRESHOLD)) {
         Obj* object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
     }
+    if (vm.grayCount == 0) {
+        return;
+    }
+
+    vm.parallelMarking = true;
+    vm.busyWorkers = 0;
+    pthread_t threads[GC_MARK_WORKERS];
+    int started = 0;
+    for (int i = 1; i < workers; i++) {
+        // 创建失败就少一个worker，发起线程自己照样能把活干完
+        if (pthread_create(&threads[started], NULL, markWorker, vmCurrent) !=
+            0) {
+            break;
+        }
+        started++;
+    }
+    // 发起GC的线程自己也算一个worker
+    markWorker(vmCurrent);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    vm.parallelMarking = false;
 }
 
-// 擦除未标记对象
-static void sweep() {
-    Obj* previous = NULL;
-    // 这里是所有对象链表
+// 擦除年轻代中未标记的对象，存活的晋升到老年代
+static void sweepYoung() {
     Obj* object = vm.objects;
+    while (object != NULL) {
+        Obj* next = object->next;
+        if (object->isMarked) {
+            // 改为未标记，为下次GC做准备
+            object->isMarked = false;
+            // 晋升：熬过一次GC的对象大概率长寿，转移到老年代链表
+            object->isOld = true;
+            object->next = vm.oldObjects;
+            vm.oldObjects = object;
+        } else {
+            // 未被标记的清除内存
+            freeObject(object);
+        }
+        object = next;
+    }
+    // 年轻代清空，存活的都晋升走了
+    vm.objects = NULL;
+}
+
+// 擦除老年代中未标记的对象，只有major GC会走到这里
+static void sweepOld() {
+    Obj* previous = NULL;
+    Obj* object = vm.oldObjects;
     while (object != NULL) {
         if (object->isMarked) {
             // 改为未标记，为下次GC做准备。这次的遍历不会再到这个对象了，不影响后的遍历。
@@ -249,7 +551,7 @@ static void sweep() {
             if (previous != NULL) {
                 previous->next = object;
             } else {
-                vm.objects = object;
+                vm.oldObjects = object;
             }
 
             freeObject(unreached);
@@ -257,24 +559,99 @@ static void sweep() {
     }
 }
 
-// 执行垃圾回收
+// GC阶段计时用的单调墙钟秒数。clock()是整个进程所有线程CPU时间之和，
+// 并行trace的worker一跑，读数会虚高到接近worker数倍，这里要的是真实停顿
+static double gcNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// 执行垃圾回收。平时只做minor（回收年轻代），堆涨到major阈值时做全堆回收
 void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    // 是否只回收年轻代
+    bool minor = vm.bytesAllocated <= vm.nextMajorGC;
+    vm.gcMinor = minor;
+
     size_t before = vm.bytesAllocated;
+    double phaseStart = gcNow();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin (%s)\n", minor ? "minor" : "major");
 #endif
     // 从根对象开始标记存活对象
     markRoots();
+
+    if (minor) {
+        // 记忆集里的老年代对象被写入过新引用，直接blacken它们，
+        // 把指向的年轻对象标记出来。老年代的其余部分不用扫。
+        for (int i = 0; i < vm.rememberedCount; i++) {
+            blackenObject(vm.remembered[i]);
+        }
+        // 老年代fiber的栈每条指令都在变，写屏障罩不住它，
+        // minor时把所有老年代fiber的栈全量重扫一遍
+        for (ObjFiber* fiber = vm.allFibers; fiber != NULL;
+             fiber = fiber->allNext) {
+            if (fiber->obj.isOld) {
+                blackenObject((Obj*)fiber);
+            }
+        }
+    }
+
+    double markEnd = gcNow();
+    vm.gcStats.markTime += markEnd - phaseStart;
+
     // 标记间接引用对象
     traceReferences();
 
     // 字符串常量池需要单独处理。等上面的对象标记完之后，把哈希表中未标记的字符串删除。
     tableRemoveWhite(&vm.strings);
 
-    // 擦除未标记对象
-    sweep();
+    double traceEnd = gcNow();
+    vm.gcStats.traceTime += traceEnd - markEnd;
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    // 清空记忆集。minor后年轻代存活对象全部晋升，老->新引用已经变成老->老；
+    // 之后的写入会重新记录。必须在sweep前做，sweep可能释放记忆集里的对象。
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+
+    // 马上要被sweep释放的fiber先从全量fiber链上摘掉。
+    // 年轻代的未标记fiber每次GC都会释放，老年代的只有major才释放
+    ObjFiber** link = &vm.allFibers;
+    while (*link != NULL) {
+        ObjFiber* fiber = *link;
+        bool dying =
+            !fiber->obj.isMarked && (!fiber->obj.isOld || !minor);
+        if (dying) {
+            *link = fiber->allNext;
+        } else {
+            link = &fiber->allNext;
+        }
+    }
+
+    // 擦除未标记对象。major必须先扫老年代再晋升年轻代：
+    // sweepYoung会把存活对象清掉标记位挂进老年代链表，
+    // 顺序反了的话sweepOld会把刚晋升的存活对象当垃圾扫掉
+    if (!minor) {
+        sweepOld();
+    }
+    sweepYoung();
+    if (!minor) {
+        vm.nextMajorGC = vm.bytesAllocated * GC_MAJOR_GROW_FACTOR;
+    }
+
+    vm.nextGC = (size_t)(vm.bytesAllocated * vm.gcGrowFactor);
+    vm.gcMinor = false;
+
+    vm.gcStats.sweepTime += gcNow() - traceEnd;
+    vm.gcStats.bytesReclaimed += before - vm.bytesAllocated;
+    if (minor) {
+        vm.gcStats.minorCount++;
+    } else {
+        vm.gcStats.majorCount++;
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -283,15 +660,48 @@ void collectGarbage() {
 #endif
 }
 
+// --gc-stats的退出汇总。打到stderr，不和程序自己的输出混在一起
+void printGCStats() {
+    GCStats* stats = &vm.gcStats;
+    fprintf(stderr, "-- gc stats --\n");
+    fprintf(stderr, "  collections:     %d minor, %d major\n",
+            stats->minorCount, stats->majorCount);
+    fprintf(stderr, "  bytes reclaimed: %zu\n", stats->bytesReclaimed);
+    fprintf(stderr, "  pause time:      %.3f ms mark, %.3f ms trace, %.3f ms sweep\n",
+            stats->markTime * 1000, stats->traceTime * 1000,
+            stats->sweepTime * 1000);
+    fprintf(stderr, "  peak heap:       %zu bytes (%zu live at exit)\n",
+            stats->peakBytes, vm.bytesAllocated);
+}
+
 // 释放vm中所有的对象空间
 void freeObjects() {
-    // 遍历链表依次释放每个对象
+    // 遍历两代的链表依次释放每个对象
     Obj* object = vm.objects;
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+    object = vm.oldObjects;
+    while (object != NULL) {
+        Obj* next = object->next;
+        freeObject(object);
+        object = next;
+    }
 
     free(vm.grayStack);
+    free(vm.remembered);
+
+    // 把这个VM的内存池slab整体归还给系统
+    Slab* slab = (Slab*)vm.poolSlabs;
+    while (slab != NULL) {
+        Slab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    vm.poolSlabs = NULL;
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        vm.poolFree[i] = NULL;
+    }
 }
@@ -4,6 +4,10 @@
 #include "common.h"
 #include "object.h"
 
+// 小对象内存池的大小档位数量：16、32、64、128四档。
+// 空闲链表挂在VM上下文里，每个VM有自己独立的内存池
+#define POOL_CLASS_COUNT 4
+
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -57,6 +61,21 @@ void markValue(Value value);
  */
 void collectGarbage();
 
+/**
+ * @brief 写屏障。向object里写入了其他对象的引用时调用。
+ * 老年代对象会被记入记忆集，minor GC时当作额外的根扫描，
+ * 保证「老对象指向年轻对象」的引用不会被漏掉。年轻代对象上是空操作。
+ * 
+ * @param object 被写入的对象
+ */
+void writeBarrier(Obj* object);
+
+/**
+ * @brief 把累计的GC统计（次数、回收字节、各阶段停顿、峰值堆）打到stderr。
+ * --gc-stats模式在脚本跑完后调用
+ */
+void printGCStats();
+
 void freeObjects();
 
 #endif
\ No newline at end of file
@@ -1,6 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -16,8 +21,11 @@ static Obj* allocateObject(size_t size, ObjType type) {
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
     object->isMarked = false;
+    // 新对象都从年轻代开始
+    object->isOld = false;
+    object->isRemembered = false;
 
-    // vm上保存的所有Obj对象的链表，以便GC时使用
+    // 挂到年轻代链表上，以便GC时使用
     object->next = vm.objects;
     vm.objects = object;
 
@@ -28,6 +36,37 @@ static Obj* allocateObject(size_t size, ObjType type) {
     return object;
 }
 
+ObjChannel* newChannel() {
+    ObjChannel* channel = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+    initValueArray(&channel->queue);
+    channel->head = 0;
+    channel->waiting = NULL;
+    return channel;
+}
+
+ObjFiber* newFiber() {
+    // 先把三个数组开好再建对象。反过来的话建数组时触发GC，
+    // 遍历到fiber会读到没初始化的指针
+    Value* stack = ALLOCATE(Value, STACK_MAX);
+    CallFrame* frames = ALLOCATE(CallFrame, FRAMES_MAX);
+    ObjUpvalue** slots = ALLOCATE(ObjUpvalue*, STACK_MAX);
+    for (int i = 0; i < STACK_MAX; i++) {
+        slots[i] = NULL;
+    }
+
+    ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->stack = stack;
+    fiber->stackTop = stack;
+    fiber->frames = frames;
+    fiber->frameCount = 0;
+    fiber->openUpvalueSlots = slots;
+    fiber->next = NULL;
+    // 挂到全量fiber链上，minor GC靠它重扫老年代fiber的栈
+    fiber->allNext = vm.allFibers;
+    vm.allFibers = fiber;
+    return fiber;
+}
+
 // 创建运行时方法对象
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
@@ -40,6 +79,8 @@ ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->vtable = NULL;
+    klass->vtableCapacity = 0;
     return klass;
 }
 
@@ -61,6 +102,7 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->callCount = 0;
     function->name = NULL;
     // 初始化指令数组空间
     initChunk(&function->chunk);
@@ -75,18 +117,93 @@ ObjInstance* newInstance(ObjClass* klass) {
     return instance;
 }
 
+// 创建空列表
+ObjList* newList() {
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    return list;
+}
+
 ObjNative* newNative(NativeFn function) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-// 根据传入的字符串和长度，创建ObjString对象
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// 创建一个拼接节点
+ObjRope* newRope(Value left, Value right, int length) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flattened = NULL;
+    return rope;
+}
+
+ObjString* ropeFlatten(ObjRope* rope) {
+    // 摊平过直接用缓存
+    if (rope->flattened != NULL) {
+        return rope->flattened;
+    }
+
+    // 一次性开好最终长度的缓冲区
+    char* buffer = ALLOCATE(char, rope->length + 1);
+    char* dest = buffer;
+
+    // 迭代遍历。循环里 s = s + x 会堆出很深的左斜树，递归会爆栈。
+    // 显式栈不走GC分配，遍历途中不会触发回收
+    int capacity = 8;
+    int count = 0;
+    Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+    if (stack == NULL)
+        exit(1);
+    stack[count++] = OBJ_VAL(rope);
+
+    while (count > 0) {
+        Value value = stack[--count];
+        if (IS_STRING(value)) {
+            ObjString* string = AS_STRING(value);
+            memcpy(dest, string->chars, string->length);
+            dest += string->length;
+        } else {
+            ObjRope* node = AS_ROPE(value);
+            if (node->flattened != NULL) {
+                // 子树已经摊平过，直接拷缓存
+                memcpy(dest, node->flattened->chars,
+                       node->flattened->length);
+                dest += node->flattened->length;
+            } else {
+                if (count + 2 > capacity) {
+                    capacity *= 2;
+                    stack = (Value*)realloc(stack, sizeof(Value) * capacity);
+                    if (stack == NULL)
+                        exit(1);
+                }
+                // 先压右再压左，保证从左往右拷贝
+                stack[count++] = node->right;
+                stack[count++] = node->left;
+            }
+        }
+    }
+    free(stack);
+
+    // takeString会interning并回收buffer
+    ObjString* result = takeString(buffer, rope->length);
+    rope->flattened = result;
+    // rope可能在老年代，缓存的字符串是新对象
+    writeBarrier((Obj*)rope);
+    return result;
+}
+
+// 根据传入的字符串和长度，创建ObjString对象。字符拷贝进对象尾部的内联数组
+static ObjString* allocateString(const char* chars, int length, uint32_t hash) {
+    ObjString* string = (ObjString*)allocateObject(
+        sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
     string->hash = hash;
+    string->selector = -1;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
 
     // push再pop防止过程中GC回收掉
     push(OBJ_VAL(string));
@@ -96,19 +213,62 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
 }
 
 /**
- * @brief 计算字符串的hash值 （FNV-1a）
+ * @brief 计算字符串的hash值。按8字节宽加载做乘法混合，
+ * 长字符串不再一个字节一个字节地走
  *
  * @param key
  * @param length
  * @return uint32_t
  */
 static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+#ifdef __SSE4_2__
+    // x86有SSE4.2时直接用硬件CRC32C指令，每次吃8个字节
+    uint64_t hash = 2166136261u ^ (uint64_t)length;
+    const char* p = key;
+    int remaining = length;
+    while (remaining >= 8) {
+        uint64_t block;
+        memcpy(&block, p, sizeof(block));
+        hash = _mm_crc32_u64(hash, block);
+        p += 8;
+        remaining -= 8;
     }
-    return hash;
+    while (remaining > 0) {
+        hash = _mm_crc32_u8((uint32_t)hash, (uint8_t)*p++);
+        remaining--;
+    }
+    // CRC本身只有32位，再乘法混合一轮让高低位都参与
+    hash *= 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(hash ^ (hash >> 32));
+#else
+    // 通用路径：按8字节块做64位乘法混合（wyhash/xxh3的套路），
+    // 尾巴不足8字节的部分拷进补零的块里。memcpy会被编译器优化成
+    // 一条未对齐的宽加载，不会真的调函数
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ (uint64_t)length;
+    const char* p = key;
+    int remaining = length;
+    while (remaining >= 8) {
+        uint64_t block;
+        memcpy(&block, p, sizeof(block));
+        block *= 0xC2B2AE3D27D4EB4Full;
+        block ^= block >> 31;
+        hash = (hash ^ block) * 0x9E3779B97F4A7C15ull;
+        p += 8;
+        remaining -= 8;
+    }
+    if (remaining > 0) {
+        uint64_t block = 0;
+        memcpy(&block, p, remaining);
+        block *= 0xC2B2AE3D27D4EB4Full;
+        block ^= block >> 31;
+        hash = (hash ^ block) * 0x9E3779B97F4A7C15ull;
+    }
+    // 最后一轮雪崩，让每个输入位影响所有输出位
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+#endif
 }
 
 ObjString* takeString(char* chars, int length) {
@@ -120,7 +280,10 @@ ObjString* takeString(char* chars, int length) {
         return interned;
     }
 
-    return allocateString(chars, length, hash);
+    // 字符会被拷进对象内部，临时缓冲区用完即还
+    ObjString* string = allocateString(chars, length, hash);
+    FREE_ARRAY(char, chars, length + 1);
+    return string;
 }
 
 ObjString* copyString(const char* chars, int length) {
@@ -128,13 +291,8 @@ ObjString* copyString(const char* chars, int length) {
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL)
         return interned;
-    // 先开辟字符的空间
-    char* heapChars = ALLOCATE(char, length + 1);
-    // 拷贝字符数组
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    // 创建对象
-    return allocateString(heapChars, length, hash);
+    // allocateString自己会拷贝字符，不再需要中间缓冲区
+    return allocateString(chars, length, hash);
 }
 
 // 创建一个ObjUpvalue
@@ -142,7 +300,6 @@ ObjUpvalue* newUpvalue(Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
-    upvalue->next = NULL;
     return upvalue;
 }
 
@@ -159,21 +316,43 @@ void printObject(Value value) {
         case OBJ_BOUND_METHOD:
             printFunction(AS_BOUND_METHOD(value)->method->function);
             break;
+        case OBJ_CHANNEL:
+            printf("<channel>");
+            break;
         case OBJ_CLASS:
             printf("%s", AS_CLASS(value)->name->chars);
             break;
         case OBJ_CLOSURE:
             printFunction(AS_CLOSURE(value)->function);
             break;
+        case OBJ_FIBER:
+            printf("<fiber>");
+            break;
         case OBJ_FUNCTION:
             printFunction(AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE:
             printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
             break;
+        case OBJ_LIST: {
+            ObjList* list = AS_LIST(value);
+            printf("[");
+            for (int i = 0; i < list->items.count; i++) {
+                if (i > 0) {
+                    printf(", ");
+                }
+                printValue(list->items.values[i]);
+            }
+            printf("]");
+            break;
+        }
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_ROPE:
+            // 打印时才摊平。调用方保证rope还在栈上，摊平中的分配是安全的
+            printf("%s", ropeFlatten(AS_ROPE(value))->chars);
+            break;
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
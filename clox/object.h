@@ -10,20 +10,29 @@
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+// 是否是个channel对象
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+// 是否是个列表对象
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+// 是否是个rope拼接节点
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 // 是否是个string对象
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_CHANNEL(value) ((ObjChannel*)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 // Object转成ObjString
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 // Object转成字符串（chars）
@@ -32,11 +41,15 @@
 // 对象类型 string instence function 等等
 typedef enum {
     OBJ_BOUND_METHOD,
+    OBJ_CHANNEL,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FIBER,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
     OBJ_NATIVE,
+    OBJ_ROPE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
@@ -45,7 +58,9 @@ typedef enum {
 struct Obj {
     ObjType type;      // 对象类型
     bool isMarked;     // 是否被CG检测标记为存活
-    struct Obj* next;  // VM中的所有对象链表，方便清除内存
+    bool isOld;  // 是否在老年代。新对象都在年轻代，熬过一次minor GC后晋升
+    bool isRemembered;  // 是否已经在记忆集里，避免重复记录
+    struct Obj* next;  // 所在代的对象链表，方便清除内存
 };
 
 // 函数对象
@@ -53,8 +68,9 @@ typedef struct {
     Obj obj;
     int arity;         // 函数入参数量
     int upvalueCount;  // 函数里有几个闭包变量
-    Chunk chunk;       // 函数的所有指令
-    ObjString* name;   // 函数名称
+    int callCount;  // 被调用的次数。达到阈值后会被当作热函数再优化一轮
+    Chunk chunk;    // 函数的所有指令
+    ObjString* name;  // 函数名称
 } ObjFunction;
 
 // 定义 NativeFn 函数
@@ -71,16 +87,47 @@ struct ObjString {
     Obj obj;  // 第一个字段是Obj类型，这样 *ObjString 可以直接转成
               // *Obj，相当于继承的功能
     int length;     // 字符串的长度
-    char* chars;    // 开始字符的引用
     uint32_t hash;  // 字符串hash值
+    int selector;   // 这个名字作为方法名时的selector编号，-1代表还没分配。
+                    // 字符串是全VM内唯一的，编号挂在这里方法分发就能
+                    // 一次加载拿到，不用再查哈希表
+    char chars[];   // 字符内容，内联在对象尾部。一次分配搞定对象和字符，
+                    // hash和比较时也不用再多跳一次指针
 };
 
+// 字符串拼接节点（rope）。VM内部使用，对lox代码不可见。
+// 长字符串相加时只挂一个这样的节点，O(1)，避免循环拼接时的平方级拷贝。
+// 需要真正的字符内容（打印、比较）时才通过ropeFlatten摊平成ObjString
+typedef struct ObjRope {
+    Obj obj;
+    int length;            // 拼接后的总长度
+    Value left;            // 左操作数，string或rope
+    Value right;           // 右操作数，string或rope
+    ObjString* flattened;  // 摊平结果缓存。NULL代表还没摊平过
+} ObjRope;
+
+// 列表对象。元素放在连续的Value数组里（复用ValueArray），
+// 按下标存取是O(1)的数组寻址，密集数字数据的遍历能吃满缓存行
+typedef struct {
+    Obj obj;
+    ValueArray items;  // 元素数组
+} ObjList;
+
+// channel对象，fiber之间传值用。send往队列里追加值（不阻塞），
+// receive从队头取值，队列空时当前fiber挂到waiting链表上等待。
+// fiber结构和执行机制在vm.h里（它依赖CallFrame）
+typedef struct ObjChannel {
+    Obj obj;
+    ValueArray queue;  // 已发送待接收的值，FIFO
+    int head;  // 队头索引。接收时只移动索引，不挪动数组，追平count后一起归零
+    struct ObjFiber* waiting;  // 等待接收的fiber链表（借用fiber的next字段串起来）
+} ObjChannel;
+
 // 代表一个运行时闭包变量
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;  // 变量值指针
     Value closed;
-    struct ObjUpvalue* next;
 } ObjUpvalue;
 
 // 闭包函数对象。包含函数本身和引用上级函数的变量列表（ObjUpvalue）
@@ -91,11 +138,15 @@ typedef struct {
     int upvalueCount;
 } ObjClosure;
 
-// 类
-typedef struct {
+// 类。带struct tag是因为chunk.h的内联缓存需要前向引用这个类型
+typedef struct ObjClass {
     Obj obj;
     ObjString* name;  // 类名
     Table methods;    // 类包含的方法
+    Value* vtable;  // 按selector编号索引的密集方法表。vtable[sel]是对应
+                    // 方法的闭包，空槽是nil。内容是methods表的子集，
+                    // 方法分发走这里只要一次带边界检查的数组加载
+    int vtableCapacity;  // vtable数组容量
 } ObjClass;
 
 // 对象实例
@@ -114,6 +165,9 @@ typedef struct {
 
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 
+// 创建一个空channel
+ObjChannel* newChannel();
+
 ObjClass* newClass(ObjString* name);
 
 ObjClosure* newClosure(ObjFunction* function);
@@ -122,8 +176,23 @@ ObjFunction* newFunction();
 
 ObjInstance* newInstance(ObjClass* klass);
 
+// 创建一个空列表
+ObjList* newList();
+
 ObjNative* newNative(NativeFn function);
 
+// 创建一个拼接节点。left和right必须已经在GC可达的位置（比如VM栈上）
+ObjRope* newRope(Value left, Value right, int length);
+
+/**
+ * @brief 把rope摊平成真正的ObjString（带interning），结果会缓存在节点上。
+ * rope本身必须GC可达，摊平过程中会分配内存。
+ *
+ * @param rope 拼接节点
+ * @return ObjString*
+ */
+ObjString* ropeFlatten(ObjRope* rope);
+
 // 根据字符引用和长度，生成一个ObjString
 ObjString* takeString(char* chars, int length);
 
@@ -0,0 +1,208 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "object.h"
+#include "profiler.h"
+#include "vm.h"
+
+// 采样间隔（微秒）。ITIMER_PROF按进程消耗的CPU时间计
+#define SAMPLE_INTERVAL_US 1000
+
+bool profilerActive = false;
+
+// 定时器到期标志。信号处理器里只写这个，采样本身在主循环做
+static volatile sig_atomic_t samplePending = 0;
+
+// 每个opcode被执行的次数
+static uint64_t opcodeCounts[UINT8_COUNT];
+
+// 一种collapsed调用栈（"script;outer;inner"）和它被采样到的次数
+typedef struct {
+    char* stack;
+    long count;
+} StackSample;
+
+// 一个函数名和它作为栈顶（self时间）被采样到的次数
+typedef struct {
+    char* name;
+    long self;
+} FunctionSample;
+
+static StackSample* stacks = NULL;
+static int stackCount = 0;
+static int stackCapacity = 0;
+
+static FunctionSample* functions = NULL;
+static int functionCount = 0;
+static int functionCapacity = 0;
+
+static long totalSamples = 0;
+
+static void onTimer(int sig) {
+    samplePending = 1;
+}
+
+void profilerStart() {
+    profilerActive = true;
+
+    struct sigaction action;
+    action.sa_handler = onTimer;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = SAMPLE_INTERVAL_US;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// frame对应的函数名。顶级代码没有名字，统一叫script
+static const char* frameName(CallFrame* frame) {
+    ObjFunction* function = frame->closure->function;
+    return function->name == NULL ? "script" : function->name->chars;
+}
+
+// 栈顶函数的self计数加一
+static void bumpFunction(const char* name) {
+    for (int i = 0; i < functionCount; i++) {
+        if (strcmp(functions[i].name, name) == 0) {
+            functions[i].self++;
+            return;
+        }
+    }
+    if (functionCapacity < functionCount + 1) {
+        functionCapacity = functionCapacity < 8 ? 8 : functionCapacity * 2;
+        functions = (FunctionSample*)realloc(
+            functions, sizeof(FunctionSample) * functionCapacity);
+        if (functions == NULL)
+            exit(1);
+    }
+    functions[functionCount].name = strdup(name);
+    functions[functionCount].self = 1;
+    functionCount++;
+}
+
+// 抓一次当前fiber的调用栈快照
+static void takeSample() {
+    samplePending = 0;
+    if (vm.frameCount == 0) {
+        return;
+    }
+    totalSamples++;
+
+    bumpFunction(frameName(&vm.frames[vm.frameCount - 1]));
+
+    // 从栈底到栈顶拼成collapsed形式："script;outer;inner"
+    size_t length = 0;
+    for (int i = 0; i < vm.frameCount; i++) {
+        length += strlen(frameName(&vm.frames[i])) + 1;
+    }
+    char* buffer = (char*)malloc(length);
+    if (buffer == NULL)
+        exit(1);
+    char* dest = buffer;
+    for (int i = 0; i < vm.frameCount; i++) {
+        if (i > 0) {
+            *dest++ = ';';
+        }
+        const char* name = frameName(&vm.frames[i]);
+        size_t nameLength = strlen(name);
+        memcpy(dest, name, nameLength);
+        dest += nameLength;
+    }
+    *dest = '\0';
+
+    // 相同的栈合并计数
+    for (int i = 0; i < stackCount; i++) {
+        if (strcmp(stacks[i].stack, buffer) == 0) {
+            stacks[i].count++;
+            free(buffer);
+            return;
+        }
+    }
+    if (stackCapacity < stackCount + 1) {
+        stackCapacity = stackCapacity < 8 ? 8 : stackCapacity * 2;
+        stacks = (StackSample*)realloc(stacks,
+                                       sizeof(StackSample) * stackCapacity);
+        if (stacks == NULL)
+            exit(1);
+    }
+    stacks[stackCount].stack = buffer;
+    stacks[stackCount].count = 1;
+    stackCount++;
+}
+
+void profilerRecord(uint8_t opcode) {
+    opcodeCounts[opcode]++;
+    if (samplePending) {
+        takeSample();
+    }
+}
+
+// 按self降序排函数，按count降序排栈
+static int compareFunctions(const void* a, const void* b) {
+    long diff = ((FunctionSample*)b)->self - ((FunctionSample*)a)->self;
+    return diff > 0 ? 1 : diff < 0 ? -1 : 0;
+}
+
+static int compareCounts(const void* a, const void* b) {
+    uint64_t ca = opcodeCounts[*(const uint8_t*)a];
+    uint64_t cb = opcodeCounts[*(const uint8_t*)b];
+    return cb > ca ? 1 : cb < ca ? -1 : 0;
+}
+
+void profilerReport() {
+    // 先把定时器停掉，报告期间不再采样
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    uint64_t totalOps = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        totalOps += opcodeCounts[i];
+    }
+
+    fprintf(stderr, "-- profile: %llu instructions, %ld samples --\n",
+            (unsigned long long)totalOps, totalSamples);
+
+    // 按函数的self时间（作为栈顶被采样到的比例）
+    fprintf(stderr, "\nself time by function:\n");
+    qsort(functions, functionCount, sizeof(FunctionSample), compareFunctions);
+    for (int i = 0; i < functionCount; i++) {
+        fprintf(stderr, "  %6.1f%% %8ld  %s\n",
+                100.0 * functions[i].self / totalSamples, functions[i].self,
+                functions[i].name);
+    }
+
+    // opcode直方图，零次的不打
+    fprintf(stderr, "\nopcode histogram:\n");
+    uint8_t order[UINT8_COUNT];
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        order[i] = (uint8_t)i;
+    }
+    qsort(order, UINT8_COUNT, sizeof(uint8_t), compareCounts);
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        uint64_t count = opcodeCounts[order[i]];
+        if (count == 0) {
+            break;
+        }
+        fprintf(stderr, "  %6.1f%% %12llu  %s\n", 100.0 * count / totalOps,
+                (unsigned long long)count, opcodeName(order[i]));
+    }
+
+    // flamegraph.pl能直接吃的collapsed stack格式
+    FILE* folded = fopen("profile.folded", "w");
+    if (folded != NULL) {
+        for (int i = 0; i < stackCount; i++) {
+            fprintf(folded, "%s %ld\n", stacks[i].stack, stacks[i].count);
+        }
+        fclose(folded);
+        fprintf(stderr, "\ncollapsed stacks written to profile.folded\n");
+    }
+}
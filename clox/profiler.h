@@ -0,0 +1,29 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "common.h"
+
+// --profile模式是否开启。关闭时解释器主循环里只多一个可预测的分支
+extern bool profilerActive;
+
+/**
+ * @brief 开启profile模式：装一个SIGPROF定时器做栈采样。
+ * 定时器信号只置一个标志，真正的采样在主循环的安全点做
+ */
+void profilerStart();
+
+/**
+ * @brief 每条指令分发前调用（只在profilerActive时）。
+ * 累加opcode命中计数；定时器到期了就顺便抓一次调用栈快照
+ *
+ * @param opcode 即将执行的指令
+ */
+void profilerRecord(uint8_t opcode);
+
+/**
+ * @brief 退出前输出报告：按函数的self采样数、opcode直方图打到stderr，
+ * flamegraph可用的collapsed stack写入profile.folded
+ */
+void profilerReport();
+
+#endif
@@ -14,7 +14,8 @@ typedef struct {
     int line;             // 行数
 } Scanner;
 
-Scanner scanner;
+// 和编译器状态一样按线程隔离，多个线程各自编译时互不干扰
+_Thread_local Scanner scanner;
 
 /**
  * @brief 初始化扫描器
@@ -28,12 +29,24 @@ void initScanner(const char* source) {
     scanner.line = 1;
 }
 
+// 字符分类。identifier和数字的扫描是编译期最热的循环，
+// 查表一次加载出分类，比逐个范围比较省分支
+#define CHAR_ALPHA 1
+#define CHAR_DIGIT 2
+
+static const uint8_t charClass[256] = {
+    ['a' ... 'z'] = CHAR_ALPHA,
+    ['A' ... 'Z'] = CHAR_ALPHA,
+    ['_'] = CHAR_ALPHA,
+    ['0' ... '9'] = CHAR_DIGIT,
+};
+
 static bool isAlpha(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    return (charClass[(uint8_t)c] & CHAR_ALPHA) != 0;
 }
 
 static bool isDigit(char c) {
-    return c >= '0' && c <= '9';
+    return (charClass[(uint8_t)c] & CHAR_DIGIT) != 0;
 }
 
 // 是否到达结尾
@@ -121,9 +134,13 @@ static void skipWhitespace() {
             case '/':
                 // 如果两个斜杆，后面的都算注释，跳过，直到换行
                 if (peekNext() == '/') {
-                    // A comment goes until the end of the line.
-                    while (peek() != '\n' && !isAtEnd())
-                        advance();
+                    // 注释一口气跳到行尾。strchr是libc的SIMD实现，
+                    // 长注释不用一个字节一个字节地挪；没有换行就是文件结尾
+                    const char* newline = strchr(scanner.current, '\n');
+                    scanner.current = newline != NULL
+                                          ? newline
+                                          : scanner.current +
+                                                strlen(scanner.current);
                 } else {
                     return;
                 }
@@ -229,8 +246,13 @@ static TokenType identifierType() {
  * @return Token
  */
 static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek()))
-        advance();
+    // 热循环：分类表里非零的都是identifier的合法后续字符，
+    // 一次查表顶原来的四次范围比较
+    const char* p = scanner.current;
+    while (charClass[(uint8_t)*p] != 0) {
+        p++;
+    }
+    scanner.current = p;
     return makeToken(identifierType());
 }
 
@@ -293,6 +315,10 @@ Token scanToken() {
             return makeToken(TOKEN_LEFT_BRACE);
         case '}':
             return makeToken(TOKEN_RIGHT_BRACE);
+        case '[':
+            return makeToken(TOKEN_LEFT_BRACKET);
+        case ']':
+            return makeToken(TOKEN_RIGHT_BRACKET);
         case ';':
             return makeToken(TOKEN_SEMICOLON);
         case ',':
@@ -0,0 +1,1035 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "serialize.h"
+#include "vm.h"
+
+// 常量池里值的类型标签
+#define SER_NUMBER 'N'
+#define SER_STRING 'S'
+#define SER_FUNCTION 'F'
+
+// ---------------- 写入 ----------------
+
+static void writeU32(FILE* out, uint32_t value) {
+    fwrite(&value, sizeof(uint32_t), 1, out);
+}
+
+// 写入一个字符串：长度+字符内容
+static void writeString(FILE* out, ObjString* string) {
+    writeU32(out, (uint32_t)string->length);
+    fwrite(string->chars, sizeof(char), string->length, out);
+}
+
+// 递归写入一个函数和它的chunk
+static void writeFunction(FILE* out, ObjFunction* function) {
+    writeU32(out, (uint32_t)function->arity);
+    writeU32(out, (uint32_t)function->upvalueCount);
+
+    // 函数名。顶级函数没有名字，用长度0xffffffff表示NULL
+    if (function->name == NULL) {
+        writeU32(out, 0xffffffff);
+    } else {
+        writeString(out, function->name);
+    }
+
+    Chunk* chunk = &function->chunk;
+    // 指令数组
+    writeU32(out, (uint32_t)chunk->count);
+    fwrite(chunk->code, sizeof(uint8_t), chunk->count, out);
+    // 行号游程数组
+    writeU32(out, (uint32_t)chunk->lineRunCount);
+    fwrite(chunk->lineRuns, sizeof(LineRun), chunk->lineRunCount, out);
+    // 内联缓存只需要数量，缓存内容是运行时状态，加载后从空缓存开始
+    writeU32(out, (uint32_t)chunk->cacheCount);
+
+    // 常量池，每个值带类型标签
+    writeU32(out, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_NUMBER(value)) {
+            fputc(SER_NUMBER, out);
+            double number = AS_NUMBER(value);
+            fwrite(&number, sizeof(double), 1, out);
+        } else if (IS_STRING(value)) {
+            fputc(SER_STRING, out);
+            writeString(out, AS_STRING(value));
+        } else {
+            // 编译产物的常量池里只会有数字、字符串和嵌套函数
+            fputc(SER_FUNCTION, out);
+            writeFunction(out, AS_FUNCTION(value));
+        }
+    }
+}
+
+bool saveBytecode(ObjFunction* function, const char* path) {
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    // 文件头
+    fwrite(BYTECODE_MAGIC, sizeof(char), 4, out);
+    writeU32(out, BYTECODE_VERSION);
+
+    // 全局变量槽的名称表，按槽索引顺序。加载时按同样的顺序重新分配，
+    // 指令里的槽索引就仍然有效
+    writeU32(out, (uint32_t)vm.globalCount);
+    for (int i = 0; i < vm.globalCount; i++) {
+        writeString(out, vm.globals[i].name);
+    }
+
+    // 顶级函数（递归包含所有嵌套函数）
+    writeFunction(out, function);
+
+    fclose(out);
+    return true;
+}
+
+// ---------------- 读取 ----------------
+
+// 读取游标，直接指向mmap映射的内存
+typedef struct {
+    const uint8_t* current;  // 当前读取位置
+    const uint8_t* end;      // 映射结尾，用于越界检查
+    bool hadError;           // 是否遇到了损坏的数据
+} Reader;
+
+// 越界或者数据损坏时记录错误。后续的读取会全部返回0值，最外层统一报错
+static void readerError(Reader* reader) {
+    reader->hadError = true;
+    reader->current = reader->end;
+}
+
+static uint32_t readU32(Reader* reader) {
+    if (reader->end - reader->current < (ptrdiff_t)sizeof(uint32_t)) {
+        readerError(reader);
+        return 0;
+    }
+    uint32_t value;
+    memcpy(&value, reader->current, sizeof(uint32_t));
+    reader->current += sizeof(uint32_t);
+    return value;
+}
+
+static uint8_t readByte(Reader* reader) {
+    if (reader->current >= reader->end) {
+        readerError(reader);
+        return 0;
+    }
+    return *reader->current++;
+}
+
+// 借出映射内存里length个字节，不拷贝
+static const uint8_t* readBytes(Reader* reader, size_t length) {
+    if ((size_t)(reader->end - reader->current) < length) {
+        readerError(reader);
+        return NULL;
+    }
+    const uint8_t* start = reader->current;
+    reader->current += length;
+    return start;
+}
+
+// 读取一个字符串，借助字符串缓存表interning
+static ObjString* readString(Reader* reader) {
+    uint32_t length = readU32(reader);
+    const uint8_t* chars = readBytes(reader, length);
+    if (chars == NULL) {
+        return NULL;
+    }
+    return copyString((const char*)chars, (int)length);
+}
+
+// 递归读取一个函数
+static ObjFunction* readFunction(Reader* reader) {
+    ObjFunction* function = newFunction();
+    // 填充过程中会分配内存，可能触发GC，先push保证函数本身可达
+    push(OBJ_VAL(function));
+
+    function->arity = (int)readU32(reader);
+    function->upvalueCount = (int)readU32(reader);
+
+    uint32_t nameLength = readU32(reader);
+    if (nameLength != 0xffffffff) {
+        const uint8_t* nameChars = readBytes(reader, nameLength);
+        if (nameChars != NULL) {
+            function->name = copyString((const char*)nameChars, (int)nameLength);
+            // 填充中途函数可能已经晋升老年代，年轻的名字字符串要记账
+            writeBarrier((Obj*)function);
+        }
+    }
+
+    Chunk* chunk = &function->chunk;
+    uint32_t count = readU32(reader);
+    const uint8_t* code = readBytes(reader, count);
+    if (code != NULL) {
+        // 指令拷贝进VM自己的内存，让freeChunk可以统一释放
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, 0, count);
+        memcpy(chunk->code, code, count);
+        chunk->count = (int)count;
+        chunk->capacity = (int)count;
+    }
+
+    // 行号游程数组
+    uint32_t lineRunCount = readU32(reader);
+    const uint8_t* lineRuns = readBytes(reader, lineRunCount * sizeof(LineRun));
+    if (lineRuns != NULL && lineRunCount > 0) {
+        chunk->lineRuns = GROW_ARRAY(LineRun, chunk->lineRuns, 0, lineRunCount);
+        memcpy(chunk->lineRuns, lineRuns, lineRunCount * sizeof(LineRun));
+        chunk->lineRunCount = (int)lineRunCount;
+        chunk->lineRunCapacity = (int)lineRunCount;
+    }
+
+    // 重建空的内联缓存槽
+    uint32_t cacheCount = readU32(reader);
+    for (uint32_t i = 0; i < cacheCount && !reader->hadError; i++) {
+        addCache(chunk);
+    }
+
+    // 常量池
+    uint32_t constantCount = readU32(reader);
+    for (uint32_t i = 0; i < constantCount && !reader->hadError; i++) {
+        uint8_t tag = readByte(reader);
+        switch (tag) {
+            case SER_NUMBER: {
+                const uint8_t* bits = readBytes(reader, sizeof(double));
+                if (bits == NULL) {
+                    break;
+                }
+                double number;
+                memcpy(&number, bits, sizeof(double));
+                addConstant(chunk, NUMBER_VAL(number));
+                break;
+            }
+            case SER_STRING: {
+                ObjString* string = readString(reader);
+                if (string != NULL) {
+                    addConstant(chunk, OBJ_VAL(string));
+                }
+                break;
+            }
+            case SER_FUNCTION: {
+                ObjFunction* nested = readFunction(reader);
+                if (nested != NULL) {
+                    addConstant(chunk, OBJ_VAL(nested));
+                }
+                break;
+            }
+            default:
+                readerError(reader);
+                break;
+        }
+    }
+
+    pop();
+    return reader->hadError ? NULL : function;
+}
+
+bool isBytecodeFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char magic[4];
+    size_t read = fread(magic, sizeof(char), 4, file);
+    fclose(file);
+    return read == 4 && memcmp(magic, BYTECODE_MAGIC, 4) == 0;
+}
+
+ObjFunction* loadBytecode(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    // 整个文件映射进来，按需由OS换页，省掉readFile的整体拷贝
+    void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "Could not map file \"%s\".\n", path);
+        return NULL;
+    }
+
+    Reader reader;
+    reader.current = (const uint8_t*)mapped;
+    reader.end = reader.current + st.st_size;
+    reader.hadError = false;
+
+    ObjFunction* function = NULL;
+    // 校验文件头
+    const uint8_t* magic = readBytes(&reader, 4);
+    if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, 4) != 0 ||
+        readU32(&reader) != BYTECODE_VERSION) {
+        fprintf(stderr, "Invalid bytecode file \"%s\".\n", path);
+    } else {
+        // 按原顺序重建全局变量槽。fresh的VM里native函数已经占了前几个槽，
+        // 名称必须逐个对上，否则指令里的槽索引会张冠李戴
+        uint32_t globalCount = readU32(&reader);
+        bool globalsOk = true;
+        for (uint32_t i = 0; i < globalCount && !reader.hadError; i++) {
+            ObjString* name = readString(&reader);
+            if (name == NULL || vmGlobalSlot(name) != (int)i) {
+                globalsOk = false;
+                break;
+            }
+        }
+
+        if (globalsOk && !reader.hadError) {
+            function = readFunction(&reader);
+        }
+        if (function == NULL) {
+            fprintf(stderr, "Corrupt bytecode file \"%s\".\n", path);
+        }
+    }
+
+    munmap(mapped, st.st_size);
+    return function;
+}
+
+// ---------------- 堆镜像 ----------------
+
+// 镜像里对象记录的类型标签
+#define IMG_STRING 'S'
+#define IMG_FUNCTION 'F'
+#define IMG_CLOSURE 'C'
+#define IMG_UPVALUE 'U'
+#define IMG_CLASS 'K'
+#define IMG_INSTANCE 'I'
+#define IMG_LIST 'L'
+#define IMG_BOUND 'B'
+#define IMG_NATIVE 'V'
+
+// 镜像里Value的类型标签
+#define IMG_VAL_NIL 'n'
+#define IMG_VAL_FALSE 'f'
+#define IMG_VAL_TRUE 't'
+#define IMG_VAL_NUMBER 'd'
+#define IMG_VAL_OBJ 'o'
+
+// 对象指针 -> 镜像编号的开放寻址映射。malloc自管理，
+// 不走reallocate，枚举途中不会触发GC
+typedef struct {
+    Obj** keys;
+    uint32_t* ids;
+    int count;
+    int capacity;  // 2的幂
+} ObjIdMap;
+
+static uint32_t pointerHash(Obj* key) {
+    uint64_t hash = (uint64_t)(uintptr_t)key;
+    hash *= 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(hash >> 32);
+}
+
+static bool idMapGet(ObjIdMap* map, Obj* key, uint32_t* id) {
+    if (map->count == 0) {
+        return false;
+    }
+    uint32_t index = pointerHash(key) & (map->capacity - 1);
+    while (map->keys[index] != NULL) {
+        if (map->keys[index] == key) {
+            *id = map->ids[index];
+            return true;
+        }
+        index = (index + 1) & (map->capacity - 1);
+    }
+    return false;
+}
+
+static void idMapPut(ObjIdMap* map, Obj* key, uint32_t id) {
+    if (map->count + 1 > map->capacity * 3 / 4) {
+        int oldCapacity = map->capacity;
+        Obj** oldKeys = map->keys;
+        uint32_t* oldIds = map->ids;
+        map->capacity = oldCapacity < 64 ? 64 : oldCapacity * 2;
+        map->keys = (Obj**)calloc(map->capacity, sizeof(Obj*));
+        map->ids = (uint32_t*)malloc(sizeof(uint32_t) * map->capacity);
+        if (map->keys == NULL || map->ids == NULL)
+            exit(1);
+        for (int i = 0; i < oldCapacity; i++) {
+            if (oldKeys[i] == NULL)
+                continue;
+            uint32_t index = pointerHash(oldKeys[i]) & (map->capacity - 1);
+            while (map->keys[index] != NULL) {
+                index = (index + 1) & (map->capacity - 1);
+            }
+            map->keys[index] = oldKeys[i];
+            map->ids[index] = oldIds[i];
+        }
+        free(oldKeys);
+        free(oldIds);
+    }
+
+    uint32_t index = pointerHash(key) & (map->capacity - 1);
+    while (map->keys[index] != NULL) {
+        index = (index + 1) & (map->capacity - 1);
+    }
+    map->keys[index] = key;
+    map->ids[index] = id;
+    map->count++;
+}
+
+// 镜像写出器：枚举阶段给可达对象逐个编号，写出阶段按编号顺序落盘
+typedef struct {
+    ObjIdMap map;   // 对象指针 -> 编号
+    Obj** order;    // 按编号排列的对象指针
+    int count;
+    int capacity;
+    bool hadError;  // 遇到了不能进镜像的对象
+} ImageWriter;
+
+// 给对象分配下一个编号并排进写出顺序
+static uint32_t imageAssign(ImageWriter* writer, Obj* object) {
+    if (writer->count == writer->capacity) {
+        writer->capacity = writer->capacity < 64 ? 64 : writer->capacity * 2;
+        writer->order =
+            (Obj**)realloc(writer->order, sizeof(Obj*) * writer->capacity);
+        if (writer->order == NULL)
+            exit(1);
+    }
+    uint32_t id = (uint32_t)writer->count;
+    writer->order[writer->count++] = object;
+    idMapPut(&writer->map, object, id);
+    return id;
+}
+
+// native函数对象没法序列化函数指针，找到defineNative时给它的全局名，
+// 恢复时按名字重新绑到新进程里的同名native
+static ObjString* nativeGlobalName(ObjNative* native) {
+    for (int i = 0; i < vm.globalCount; i++) {
+        if (vm.globals[i].defined && IS_NATIVE(vm.globals[i].value) &&
+            AS_OBJ(vm.globals[i].value) == (Obj*)native) {
+            return vm.globals[i].name;
+        }
+    }
+    return NULL;
+}
+
+static void imageEnumValue(ImageWriter* writer, Value value);
+
+// 深度优先遍历对象图，给每个没见过的对象编号。遍历顺序就是
+// markRoots/blackenObject走的那些引用边
+static void imageEnumObject(ImageWriter* writer, Obj* object) {
+    if (object == NULL || writer->hadError) {
+        return;
+    }
+    uint32_t id;
+    if (idMapGet(&writer->map, object, &id)) {
+        return;
+    }
+
+    switch (object->type) {
+        case OBJ_STRING:
+        case OBJ_FUNCTION:
+            // 自包含记录：函数的常量（包括嵌套函数）随记录内联
+            imageAssign(writer, object);
+            break;
+        case OBJ_ROPE: {
+            // rope只是懒惰拼接的中间形态，镜像里摊平成普通字符串，
+            // 编号直接借用摊平结果的
+            ObjString* flat = ropeFlatten((ObjRope*)object);
+            imageEnumObject(writer, (Obj*)flat);
+            if (idMapGet(&writer->map, (Obj*)flat, &id)) {
+                idMapPut(&writer->map, object, id);
+            }
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            imageAssign(writer, object);
+            imageEnumObject(writer, (Obj*)closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                imageEnumObject(writer, (Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            // 快照发生在脚本跑完之后，所有upvalue都已经关闭
+            imageAssign(writer, object);
+            imageEnumValue(writer, *((ObjUpvalue*)object)->location);
+            break;
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            imageAssign(writer, object);
+            imageEnumObject(writer, (Obj*)klass->name);
+            for (int i = 0; i < klass->methods.capacity; i++) {
+                if (klass->methods.keys[i] == NULL)
+                    continue;
+                imageEnumObject(writer, (Obj*)klass->methods.keys[i]);
+                imageEnumValue(writer, klass->methods.values[i]);
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            imageAssign(writer, object);
+            imageEnumObject(writer, (Obj*)instance->klass);
+            for (int i = 0; i < instance->fields.capacity; i++) {
+                if (instance->fields.keys[i] == NULL)
+                    continue;
+                imageEnumObject(writer, (Obj*)instance->fields.keys[i]);
+                imageEnumValue(writer, instance->fields.values[i]);
+            }
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            imageAssign(writer, object);
+            for (int i = 0; i < list->items.count; i++) {
+                imageEnumValue(writer, list->items.values[i]);
+            }
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            imageAssign(writer, object);
+            imageEnumValue(writer, bound->receiver);
+            imageEnumObject(writer, (Obj*)bound->method);
+            break;
+        }
+        case OBJ_NATIVE: {
+            ObjString* name = nativeGlobalName((ObjNative*)object);
+            if (name == NULL) {
+                fprintf(stderr,
+                        "Cannot snapshot a native function whose defining "
+                        "global was overwritten.\n");
+                writer->hadError = true;
+                break;
+            }
+            imageAssign(writer, object);
+            imageEnumObject(writer, (Obj*)name);
+            break;
+        }
+        case OBJ_CHANNEL:
+        case OBJ_FIBER:
+            // 挂起的执行状态（栈、调用帧、等待队列）不属于可快照的数据
+            fprintf(stderr, "Cannot snapshot fiber or channel objects.\n");
+            writer->hadError = true;
+            break;
+    }
+}
+
+static void imageEnumValue(ImageWriter* writer, Value value) {
+    if (IS_OBJ(value)) {
+        imageEnumObject(writer, AS_OBJ(value));
+    }
+}
+
+// 枚举阶段已经给所有可达对象编过号，这里只是查号
+static uint32_t imageObjectId(ImageWriter* writer, Obj* object) {
+    uint32_t id = 0;
+    idMapGet(&writer->map, object, &id);
+    return id;
+}
+
+static void writeImageValue(ImageWriter* writer, FILE* out, Value value) {
+    if (IS_NIL(value)) {
+        fputc(IMG_VAL_NIL, out);
+    } else if (IS_BOOL(value)) {
+        fputc(AS_BOOL(value) ? IMG_VAL_TRUE : IMG_VAL_FALSE, out);
+    } else if (IS_NUMBER(value)) {
+        fputc(IMG_VAL_NUMBER, out);
+        double number = AS_NUMBER(value);
+        fwrite(&number, sizeof(double), 1, out);
+    } else {
+        fputc(IMG_VAL_OBJ, out);
+        writeU32(out, imageObjectId(writer, AS_OBJ(value)));
+    }
+}
+
+// 写出一条对象记录。rope在枚举阶段就被摊平成字符串，不会出现在这里
+static void writeImageObject(ImageWriter* writer, FILE* out, Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING:
+            fputc(IMG_STRING, out);
+            writeString(out, (ObjString*)object);
+            break;
+        case OBJ_FUNCTION:
+            fputc(IMG_FUNCTION, out);
+            writeFunction(out, (ObjFunction*)object);
+            break;
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            fputc(IMG_CLOSURE, out);
+            writeU32(out, imageObjectId(writer, (Obj*)closure->function));
+            writeU32(out, (uint32_t)closure->upvalueCount);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                writeU32(out, imageObjectId(writer, (Obj*)closure->upvalues[i]));
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            fputc(IMG_UPVALUE, out);
+            writeImageValue(writer, out, *((ObjUpvalue*)object)->location);
+            break;
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            fputc(IMG_CLASS, out);
+            writeU32(out, imageObjectId(writer, (Obj*)klass->name));
+            writeU32(out, (uint32_t)klass->methods.count);
+            for (int i = 0; i < klass->methods.capacity; i++) {
+                if (klass->methods.keys[i] == NULL)
+                    continue;
+                writeU32(out, imageObjectId(writer, (Obj*)klass->methods.keys[i]));
+                writeU32(out,
+                         imageObjectId(writer, AS_OBJ(klass->methods.values[i])));
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            fputc(IMG_INSTANCE, out);
+            writeU32(out, imageObjectId(writer, (Obj*)instance->klass));
+            writeU32(out, (uint32_t)instance->fields.count);
+            for (int i = 0; i < instance->fields.capacity; i++) {
+                if (instance->fields.keys[i] == NULL)
+                    continue;
+                writeU32(out,
+                         imageObjectId(writer, (Obj*)instance->fields.keys[i]));
+                writeImageValue(writer, out, instance->fields.values[i]);
+            }
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            fputc(IMG_LIST, out);
+            writeU32(out, (uint32_t)list->items.count);
+            for (int i = 0; i < list->items.count; i++) {
+                writeImageValue(writer, out, list->items.values[i]);
+            }
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            fputc(IMG_BOUND, out);
+            writeImageValue(writer, out, bound->receiver);
+            writeU32(out, imageObjectId(writer, (Obj*)bound->method));
+            break;
+        }
+        case OBJ_NATIVE:
+            fputc(IMG_NATIVE, out);
+            writeU32(out, imageObjectId(
+                              writer, (Obj*)nativeGlobalName((ObjNative*)object)));
+            break;
+        default:
+            break;
+    }
+}
+
+bool saveImage(const char* path) {
+    ImageWriter writer;
+    writer.map.keys = NULL;
+    writer.map.ids = NULL;
+    writer.map.count = 0;
+    writer.map.capacity = 0;
+    writer.order = NULL;
+    writer.count = 0;
+    writer.capacity = 0;
+    writer.hadError = false;
+
+    // 从全局变量槽出发给可达对象编号。枚举里唯一会分配内存的是
+    // rope摊平，rope本身从全局可达，GC安全
+    for (int i = 0; i < vm.globalCount && !writer.hadError; i++) {
+        imageEnumObject(&writer, (Obj*)vm.globals[i].name);
+        imageEnumValue(&writer, vm.globals[i].value);
+    }
+    // 字符串缓存表也收进镜像，恢复后的进程一启动interning就是热的
+    for (int i = 0; i < vm.strings.capacity && !writer.hadError; i++) {
+        imageEnumObject(&writer, (Obj*)vm.strings.keys[i]);
+    }
+
+    FILE* out = NULL;
+    if (!writer.hadError) {
+        out = fopen(path, "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", path);
+        }
+    }
+
+    if (out != NULL) {
+        // 文件头
+        fwrite(IMAGE_MAGIC, sizeof(char), 4, out);
+        writeU32(out, IMAGE_VERSION);
+
+        // 对象记录，按编号顺序。每条记录带字节长度，加载器先把所有
+        // 记录的位置索引出来，之后就能按依赖关系乱序恢复
+        writeU32(out, (uint32_t)writer.count);
+        for (int i = 0; i < writer.count; i++) {
+            long lengthPos = ftell(out);
+            writeU32(out, 0);
+            writeImageObject(&writer, out, writer.order[i]);
+            long end = ftell(out);
+            fseek(out, lengthPos, SEEK_SET);
+            writeU32(out, (uint32_t)(end - lengthPos - 4));
+            fseek(out, end, SEEK_SET);
+        }
+
+        // 全局变量槽，按槽索引顺序
+        writeU32(out, (uint32_t)vm.globalCount);
+        for (int i = 0; i < vm.globalCount; i++) {
+            writeU32(out, imageObjectId(&writer, (Obj*)vm.globals[i].name));
+            fputc(vm.globals[i].defined ? 1 : 0, out);
+            writeImageValue(&writer, out, vm.globals[i].value);
+        }
+        fclose(out);
+    }
+
+    free(writer.map.keys);
+    free(writer.map.ids);
+    free(writer.order);
+    return out != NULL && !writer.hadError;
+}
+
+// 镜像加载器。objects数组按编号缓存已恢复的对象，引用靠它重定位
+typedef struct {
+    const uint8_t** records;   // 每条记录的起始位置（按编号索引）
+    const uint8_t* recordsEnd; // 记录区结尾（全局变量区的开始）
+    uint32_t count;
+    Obj** objects;             // 已恢复的对象（按编号索引）
+    ObjList* keep;             // 恢复中对象的GC保护列表（本身押在VM栈上）
+    bool hadError;
+} ImageLoader;
+
+// 登记一个恢复好的对象。先挂进保护列表：镜像对象在接回全局槽之前
+// 对markRoots还不可达，中途触发GC不能把它们扫走
+static void imageRegister(ImageLoader* loader, uint32_t id, Obj* object) {
+    loader->objects[id] = object;
+    push(OBJ_VAL(object));
+    writeValueArray(&loader->keep->items, OBJ_VAL(object));
+    // 保护列表活过一次minor GC就会进老年代，往里塞年轻对象必须记账
+    writeBarrier((Obj*)loader->keep);
+    pop();
+}
+
+static Obj* restoreObject(ImageLoader* loader, uint32_t id);
+
+static Value restoreValue(ImageLoader* loader, Reader* reader) {
+    switch (readByte(reader)) {
+        case IMG_VAL_NIL:
+            return NIL_VAL;
+        case IMG_VAL_FALSE:
+            return BOOL_VAL(false);
+        case IMG_VAL_TRUE:
+            return BOOL_VAL(true);
+        case IMG_VAL_NUMBER: {
+            const uint8_t* bits = readBytes(reader, sizeof(double));
+            if (bits == NULL) {
+                return NIL_VAL;
+            }
+            double number;
+            memcpy(&number, bits, sizeof(double));
+            return NUMBER_VAL(number);
+        }
+        case IMG_VAL_OBJ: {
+            Obj* object = restoreObject(loader, readU32(reader));
+            if (object == NULL) {
+                return NIL_VAL;
+            }
+            return OBJ_VAL(object);
+        }
+        default:
+            readerError(reader);
+            loader->hadError = true;
+            return NIL_VAL;
+    }
+}
+
+/**
+ * @brief 按编号恢复一个对象（还没恢复过时递归恢复它的依赖）。
+ * 套路是「先建壳登记、再填引用」：引用可以指向任何编号，包括经由
+ * 方法、upvalue、字段绕回自己的环。构造时就需要的依赖（闭包的函数、
+ * 实例的类、类名）先递归恢复，这些依赖链要么无环要么一步就碰到
+ * 已登记的对象，不会死循环
+ *
+ * @param loader 加载器
+ * @param id 对象编号
+ * @return Obj* 恢复好的对象，数据损坏时返回NULL
+ */
+static Obj* restoreObject(ImageLoader* loader, uint32_t id) {
+    if (id >= loader->count) {
+        loader->hadError = true;
+        return NULL;
+    }
+    if (loader->objects[id] != NULL) {
+        return loader->objects[id];
+    }
+
+    Reader reader;
+    reader.current = loader->records[id];
+    reader.end = loader->recordsEnd;
+    reader.hadError = false;
+
+    switch (readByte(&reader)) {
+        case IMG_STRING: {
+            ObjString* string = readString(&reader);
+            if (string != NULL) {
+                imageRegister(loader, id, (Obj*)string);
+            }
+            break;
+        }
+        case IMG_FUNCTION: {
+            ObjFunction* function = readFunction(&reader);
+            if (function != NULL) {
+                imageRegister(loader, id, (Obj*)function);
+            }
+            break;
+        }
+        case IMG_CLOSURE: {
+            // 函数记录是自包含的，先恢复它再建闭包（这条依赖不会成环）
+            Obj* function = restoreObject(loader, readU32(&reader));
+            uint32_t upvalueCount = readU32(&reader);
+            if (function == NULL || function->type != OBJ_FUNCTION ||
+                (int)upvalueCount != ((ObjFunction*)function)->upvalueCount) {
+                loader->hadError = true;
+                break;
+            }
+            ObjClosure* closure = newClosure((ObjFunction*)function);
+            // 先登记再填upvalue：upvalue的值可能绕回这个闭包自己
+            imageRegister(loader, id, (Obj*)closure);
+            for (uint32_t i = 0; i < upvalueCount && !reader.hadError; i++) {
+                Obj* upvalue = restoreObject(loader, readU32(&reader));
+                if (upvalue == NULL || upvalue->type != OBJ_UPVALUE) {
+                    loader->hadError = true;
+                    break;
+                }
+                closure->upvalues[i] = (ObjUpvalue*)upvalue;
+                writeBarrier((Obj*)closure);
+            }
+            break;
+        }
+        case IMG_UPVALUE: {
+            // 镜像里的upvalue都是关闭状态，值放在closed里
+            ObjUpvalue* upvalue = newUpvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            imageRegister(loader, id, (Obj*)upvalue);
+            upvalue->closed = restoreValue(loader, &reader);
+            writeBarrier((Obj*)upvalue);
+            break;
+        }
+        case IMG_CLASS: {
+            Obj* name = restoreObject(loader, readU32(&reader));
+            if (name == NULL || name->type != OBJ_STRING) {
+                loader->hadError = true;
+                break;
+            }
+            ObjClass* klass = newClass((ObjString*)name);
+            // 先登记再挂方法：方法闭包捕获的值可能绕回这个类
+            imageRegister(loader, id, (Obj*)klass);
+            uint32_t methodCount = readU32(&reader);
+            for (uint32_t i = 0; i < methodCount && !reader.hadError; i++) {
+                Obj* methodName = restoreObject(loader, readU32(&reader));
+                Obj* method = restoreObject(loader, readU32(&reader));
+                if (methodName == NULL || methodName->type != OBJ_STRING ||
+                    method == NULL || method->type != OBJ_CLOSURE) {
+                    loader->hadError = true;
+                    break;
+                }
+                // 和OP_METHOD同一个入口，selector编号和vtable一起重建
+                vmAddMethod(klass, (ObjString*)methodName, OBJ_VAL(method));
+            }
+            break;
+        }
+        case IMG_INSTANCE: {
+            Obj* klass = restoreObject(loader, readU32(&reader));
+            if (klass == NULL || klass->type != OBJ_CLASS) {
+                loader->hadError = true;
+                break;
+            }
+            // 类的恢复可能顺着方法引用已经把这个实例带出来了，再查一次
+            if (loader->objects[id] != NULL) {
+                return loader->objects[id];
+            }
+            ObjInstance* instance = newInstance((ObjClass*)klass);
+            imageRegister(loader, id, (Obj*)instance);
+            uint32_t fieldCount = readU32(&reader);
+            for (uint32_t i = 0; i < fieldCount && !reader.hadError; i++) {
+                Obj* fieldName = restoreObject(loader, readU32(&reader));
+                if (fieldName == NULL || fieldName->type != OBJ_STRING) {
+                    loader->hadError = true;
+                    break;
+                }
+                Value value = restoreValue(loader, &reader);
+                tableSet(&instance->fields, (ObjString*)fieldName, value);
+                writeBarrier((Obj*)instance);
+            }
+            break;
+        }
+        case IMG_LIST: {
+            ObjList* list = newList();
+            imageRegister(loader, id, (Obj*)list);
+            uint32_t count = readU32(&reader);
+            for (uint32_t i = 0; i < count && !reader.hadError; i++) {
+                // 元素对象已经在保护列表里，追加时触发GC也安全
+                writeValueArray(&list->items, restoreValue(loader, &reader));
+                writeBarrier((Obj*)list);
+            }
+            break;
+        }
+        case IMG_BOUND: {
+            Value receiver = restoreValue(loader, &reader);
+            Obj* method = restoreObject(loader, readU32(&reader));
+            if (method == NULL || method->type != OBJ_CLOSURE) {
+                loader->hadError = true;
+                break;
+            }
+            // receiver的恢复可能绕回来已经建过这个对象了
+            if (loader->objects[id] != NULL) {
+                return loader->objects[id];
+            }
+            ObjBoundMethod* bound =
+                newBoundMethod(receiver, (ObjClosure*)method);
+            imageRegister(loader, id, (Obj*)bound);
+            break;
+        }
+        case IMG_NATIVE: {
+            // 按名字重新绑定：函数指针在新进程里由initVM重建好了
+            Obj* name = restoreObject(loader, readU32(&reader));
+            if (name == NULL || name->type != OBJ_STRING) {
+                loader->hadError = true;
+                break;
+            }
+            Value slot;
+            int index = -1;
+            if (tableGet(&vm.globalNames, (ObjString*)name, &slot)) {
+                index = (int)AS_NUMBER(slot);
+            }
+            if (index < 0 || !vm.globals[index].defined ||
+                !IS_NATIVE(vm.globals[index].value)) {
+                fprintf(stderr,
+                        "Heap image references native \"%s\" that this "
+                        "binary does not define.\n",
+                        ((ObjString*)name)->chars);
+                loader->hadError = true;
+                break;
+            }
+            loader->objects[id] = AS_OBJ(vm.globals[index].value);
+            break;
+        }
+        default:
+            readerError(&reader);
+            break;
+    }
+
+    if (reader.hadError) {
+        loader->hadError = true;
+    }
+    return loader->objects[id];
+}
+
+bool isHeapImageFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char magic[4];
+    size_t read = fread(magic, sizeof(char), 4, file);
+    fclose(file);
+    return read == 4 && memcmp(magic, IMAGE_MAGIC, 4) == 0;
+}
+
+bool loadImage(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return false;
+    }
+
+    void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "Could not map file \"%s\".\n", path);
+        return false;
+    }
+
+    Reader reader;
+    reader.current = (const uint8_t*)mapped;
+    reader.end = reader.current + st.st_size;
+    reader.hadError = false;
+
+    bool ok = false;
+    // 校验文件头
+    const uint8_t* magic = readBytes(&reader, 4);
+    if (magic == NULL || memcmp(magic, IMAGE_MAGIC, 4) != 0 ||
+        readU32(&reader) != IMAGE_VERSION) {
+        fprintf(stderr, "Invalid heap image file \"%s\".\n", path);
+    } else {
+        uint32_t count = readU32(&reader);
+        // 记录至少有长度和标签5个字节，超出文件大小的数量一定是损坏
+        if ((size_t)count > (size_t)(reader.end - reader.current) / 5) {
+            readerError(&reader);
+            count = 0;
+        }
+
+        ImageLoader loader;
+        loader.count = count;
+        loader.records = (const uint8_t**)malloc(sizeof(uint8_t*) *
+                                                 (count == 0 ? 1 : count));
+        loader.objects = (Obj**)calloc(count == 0 ? 1 : count, sizeof(Obj*));
+        if (loader.records == NULL || loader.objects == NULL)
+            exit(1);
+        loader.hadError = false;
+
+        // 先扫一遍把每条记录的位置索引出来
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t length = readU32(&reader);
+            loader.records[i] = reader.current;
+            readBytes(&reader, length);
+        }
+        loader.recordsEnd = reader.current;
+
+        // 保护列表押在栈上，恢复中的对象靠它对GC可达
+        loader.keep = newList();
+        push(OBJ_VAL(loader.keep));
+
+        // 按槽索引顺序接回全局变量
+        uint32_t globalCount = readU32(&reader);
+        ok = !reader.hadError;
+        for (uint32_t i = 0; i < globalCount && ok; i++) {
+            Obj* name = restoreObject(&loader, readU32(&reader));
+            uint8_t defined = readByte(&reader);
+            Value value = restoreValue(&loader, &reader);
+            // 槽索引必须和快照进程里完全一致（native集合一致时必然
+            // 如此），否则之后编译出的指令会拿错槽
+            if (name == NULL || name->type != OBJ_STRING ||
+                vmGlobalSlot((ObjString*)name) != (int)i) {
+                ok = false;
+                break;
+            }
+            vm.globals[i].value = value;
+            vm.globals[i].defined = defined != 0;
+        }
+        ok = ok && !reader.hadError && !loader.hadError;
+
+        pop();
+        free(loader.records);
+        free(loader.objects);
+        if (!ok) {
+            fprintf(stderr, "Corrupt heap image file \"%s\".\n", path);
+        }
+    }
+
+    munmap(mapped, st.st_size);
+    return ok;
+}
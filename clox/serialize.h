@@ -0,0 +1,80 @@
+#ifndef clox_serialize_h
+#define clox_serialize_h
+
+#include "object.h"
+
+// 编译产物容器格式的magic和版本号。格式变化时必须递增版本号。
+#define BYTECODE_MAGIC "CLXB"
+// 版本2：行号表改成游程编码
+#define BYTECODE_VERSION 2
+
+// 堆镜像格式的magic和版本号。镜像记录的是跑完prelude之后的活对象图，
+// 新进程从镜像恢复，跳过prelude的编译和执行
+#define IMAGE_MAGIC "CLXI"
+#define IMAGE_VERSION 1
+
+/**
+ * @brief 判断path指向的文件是否是编译好的字节码容器（看文件头的magic）
+ *
+ * @param path 文件路径
+ * @return true
+ * @return false
+ */
+bool isBytecodeFile(const char* path);
+
+/**
+ * @brief 把编译好的顶级函数序列化到文件。
+ * 会递归写入所有嵌套函数的chunk（code、行号游程、constants），以及
+ * 全局变量槽的名称表，保证加载时槽索引和编译时一致。
+ *
+ * @param function 顶级函数
+ * @param path 输出文件路径
+ * @return true 写入成功
+ * @return false
+ */
+bool saveBytecode(ObjFunction* function, const char* path);
+
+/**
+ * @brief 从字节码容器文件加载顶级函数。
+ * 文件通过mmap映射进来，解析时直接在映射内存上读，跳过scanner和compiler。
+ *
+ * @param path 文件路径
+ * @return ObjFunction* 顶级函数，失败返回NULL
+ */
+ObjFunction* loadBytecode(const char* path);
+
+/**
+ * @brief 判断path指向的文件是否是堆镜像（看文件头的magic）
+ *
+ * @param path 文件路径
+ * @return true
+ * @return false
+ */
+bool isHeapImageFile(const char* path);
+
+/**
+ * @brief 把当前VM的活堆快照成镜像文件。
+ * 从全局变量槽出发枚举可达对象图（类、闭包、实例、列表、字符串等），
+ * 每个对象写一条带编号的记录，引用按编号重定位。native函数按全局名
+ * 记录，恢复时重新绑定；rope摊平成普通字符串。fiber和channel是挂起的
+ * 执行状态，不能进镜像，遇到会失败。
+ *
+ * @param path 输出文件路径
+ * @return true 写入成功
+ * @return false
+ */
+bool saveImage(const char* path);
+
+/**
+ * @brief 从镜像文件恢复VM的全局状态。
+ * 在刚initVM完的VM上调用：对象图按记录编号重建并重定位引用，
+ * 全局变量槽按快照时的索引顺序接回，方法的selector和vtable重新登记。
+ * 之后编译执行的脚本看到的全局环境和prelude跑完时一致。
+ *
+ * @param path 镜像文件路径
+ * @return true 恢复成功
+ * @return false
+ */
+bool loadImage(const char* path);
+
+#endif
@@ -5,6 +5,7 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
 // 最大负载因子。负载因子=count/cap
 // 达到这个值说明需要扩容了，不然后面冲突的可能性会比较大。
@@ -13,46 +14,103 @@
 void initTable(Table* table) {
     table->count = 0;
     table->capacity = 0;
-    table->entries = NULL;
+    table->hashes = NULL;
+    table->keys = NULL;
+    table->values = NULL;
 }
 
 void freeTable(Table* table) {
-    // 释放entry数组
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    // 释放三个平行数组
+    FREE_ARRAY(uint32_t, table->hashes, table->capacity);
+    FREE_ARRAY(ObjString*, table->keys, table->capacity);
+    FREE_ARRAY(Value, table->values, table->capacity);
     initTable(table);
 }
 
+// slot上现有的entry离它的理想位置有多远（探测距离）
+static uint32_t probeDistance(uint32_t hash, uint32_t slot, int capacity) {
+    return (slot + capacity - (hash & (capacity - 1))) & (capacity - 1);
+}
+
+/**
+ * @brief 向裸数组插入一个新key（调用方保证key不存在）。
+ * robin hood规则：探测途中遇到比自己离家近的entry就把它挤出来，
+ * 换它继续向后找位置，保证探测距离的分布均匀
+ *
+ * @param hashes hash元数据数组
+ * @param keys key数组
+ * @param values value数组
+ * @param capacity 容量
+ * @param hash key的hash
+ * @param key key
+ * @param value value
+ */
+static void insertEntry(uint32_t* hashes,
+                        ObjString** keys,
+                        Value* values,
+                        int capacity,
+                        uint32_t hash,
+                        ObjString* key,
+                        Value value) {
+    uint32_t index = hash & (capacity - 1);
+    uint32_t distance = 0;
+    for (;;) {
+        if (keys[index] == NULL) {
+            // 找到空槽，放进去
+            hashes[index] = hash;
+            keys[index] = key;
+            values[index] = value;
+            return;
+        }
+
+        uint32_t existing = probeDistance(hashes[index], index, capacity);
+        if (existing < distance) {
+            // 住得近的让位，被挤出来的entry继续向后找
+            uint32_t tmpHash = hashes[index];
+            ObjString* tmpKey = keys[index];
+            Value tmpValue = values[index];
+            hashes[index] = hash;
+            keys[index] = key;
+            values[index] = value;
+            hash = tmpHash;
+            key = tmpKey;
+            value = tmpValue;
+            distance = existing;
+        }
+
+        index = (index + 1) & (capacity - 1);
+        distance++;
+    }
+}
+
 /**
- * @brief 根据key查找Entry
+ * @brief 查找key所在的槽。
+ * 探测时先比hash元数据，对上了才比key指针（字符串是interned的，
+ * 指针相等就是同一个key）。robin hood不变量允许提前退出：
+ * 一旦当前槽的entry比我们已经走过的距离离家还近，key肯定不存在
  *
- * @param entries  Entry数组
- * @param capacity  当前容量
+ * @param table 哈希表引用
  * @param key key
- * @return Entry*
+ * @return int 槽索引，不存在返回-1
  */
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    // 计算数组中的索引
+static int findSlot(Table* table, ObjString* key) {
+    int capacity = table->capacity;
     uint32_t index = key->hash & (capacity - 1);
-    // 墓碑节点
-    Entry* tombstone = NULL;
+    uint32_t distance = 0;
     for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // 找到了一个空节点。如果前面遇到过墓碑节点，返回墓碑节点复用。没有当前的空节点
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // 记录遇到的第一个墓碑节点
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // 找到了
-            return entry;
+        if (table->keys[index] == NULL) {
+            return -1;
         }
-        // 如果上面没找到合适的，继续向数组下一个位置遍历。%
-        // capacity是为了遍历到末尾之后从头开始
+        if (probeDistance(table->hashes[index], index, capacity) < distance) {
+            // 比我们离家还近，后面不可能有要找的key了
+            return -1;
+        }
+        if (table->hashes[index] == key->hash && table->keys[index] == key) {
+            return (int)index;
+        }
+
         index = (index + 1) & (capacity - 1);
+        distance++;
     }
 }
 
@@ -60,11 +118,11 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0)
         return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int slot = findSlot(table, key);
+    if (slot == -1)
         return false;
-    // 把传入的引用内存数据改成entry里面的
-    *value = entry->value;
+    // 把传入的引用内存数据改成槽里面的
+    *value = table->values[slot];
     return true;
 }
 
@@ -75,30 +133,30 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
  * @param capacity 新容量
  */
 static void adjustCapacity(Table* table, int capacity) {
-    // 开辟新容量的数组空间
-    Entry* entries = ALLOCATE(Entry, capacity);
-    // 初始化每个entry
+    // 开辟新容量的三个数组空间
+    uint32_t* hashes = ALLOCATE(uint32_t, capacity);
+    ObjString** keys = ALLOCATE(ObjString*, capacity);
+    Value* values = ALLOCATE(Value, capacity);
     for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+        keys[i] = NULL;
+        values[i] = NIL_VAL;
     }
-    // count先归零。新的哈希表要去除之前的墓碑节点
-    table->count = 0;
-    // 依次把老数组的entry放入新数组
+
+    // 依次把老数组的entry插入新数组。没有墓碑，count不变
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL)
-            // 可能是个空节点或者墓碑节点，都跳过
+        if (table->keys[i] == NULL)
             continue;
-        // 找到新节点，把值拷贝过去
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        insertEntry(hashes, keys, values, capacity, table->hashes[i],
+                    table->keys[i], table->values[i]);
     }
+
     // 释放老的数组空间
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
+    FREE_ARRAY(uint32_t, table->hashes, table->capacity);
+    FREE_ARRAY(ObjString*, table->keys, table->capacity);
+    FREE_ARRAY(Value, table->values, table->capacity);
+    table->hashes = hashes;
+    table->keys = keys;
+    table->values = values;
     table->capacity = capacity;
 }
 
@@ -109,40 +167,80 @@ bool tableSet(Table* table, ObjString* key, Value value) {
         adjustCapacity(table, capacity);
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    // 是否是新的key
-    bool isNewKey = entry->key == NULL;
-    // 如果key和value都是空，则count++。 墓碑节点的vlaue不为空，也是算count的
-    if (isNewKey && IS_NIL(entry->value))
-        table->count++;
+    int slot = findSlot(table, key);
+    if (slot != -1) {
+        // 已存在，覆盖value
+        table->values[slot] = value;
+        return false;
+    }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    insertEntry(table->hashes, table->keys, table->values, table->capacity,
+                key->hash, key, value);
+    table->count++;
+    return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0)
         return false;
 
-    // Find the entry.
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int slot = findSlot(table, key);
+    if (slot == -1)
         return false;
 
-    // 将要被删除的节点标记为墓碑节点（key=null，value=true），供后面复用.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // 回填：把后面所有还没回到理想位置的entry依次向前挪一格，
+    // 直到遇到空槽或者已经在理想位置的entry。不留墓碑
+    int capacity = table->capacity;
+    uint32_t index = (uint32_t)slot;
+    for (;;) {
+        uint32_t next = (index + 1) & (capacity - 1);
+        if (table->keys[next] == NULL ||
+            probeDistance(table->hashes[next], next, capacity) == 0) {
+            break;
+        }
+        table->hashes[index] = table->hashes[next];
+        table->keys[index] = table->keys[next];
+        table->values[index] = table->values[next];
+        index = next;
+    }
+    table->keys[index] = NULL;
+    table->values[index] = NIL_VAL;
+    table->count--;
     return true;
 }
 
 void tableAddAll(Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (from->keys[i] != NULL) {
+            tableSet(to, from->keys[i], from->values[i]);
+        }
+    }
+}
+
+// 字符内容确认。短字符串按8字节宽加载直接比，省掉memcmp的调用开销；
+// 长字符串交给libc的memcmp，它本身就是SIMD实现
+static bool sameChars(const char* a, const char* b, int length) {
+    if (length > 16) {
+        return memcmp(a, b, length) == 0;
+    }
+    while (length >= 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, a, sizeof(wa));
+        memcpy(&wb, b, sizeof(wb));
+        if (wa != wb) {
+            return false;
+        }
+        a += 8;
+        b += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        if (*a++ != *b++) {
+            return false;
         }
+        length--;
     }
+    return true;
 }
 
 ObjString* tableFindString(Table* table,
@@ -153,38 +251,61 @@ ObjString* tableFindString(Table* table,
         return NULL;
     // 计算索引位置
     uint32_t index = hash & (table->capacity - 1);
+    uint32_t distance = 0;
     for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // 如果找到了非墓碑空节点，停止遍历.
-            if (IS_NIL(entry->value))
-                return NULL;
-            // 比较长度、hash、char数组，都相当时任务是相同字符串
-        } else if (entry->key->length == length && entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
+        if (table->keys[index] == NULL) {
+            // 遇到空槽，不存在
+            return NULL;
+        }
+        if (probeDistance(table->hashes[index], index, table->capacity) <
+            distance) {
+            // robin hood不变量：后面不可能有了
+            return NULL;
+        }
+        // 先比hash，再比较长度和char数组，都相等时认为是相同字符串
+        if (table->hashes[index] == hash &&
+            table->keys[index]->length == length &&
+            sameChars(table->keys[index]->chars, chars, length)) {
             // We found it.
-            return entry->key;
+            return table->keys[index];
         }
 
         index = (index + 1) & (table->capacity - 1);
+        distance++;
     }
 }
 
 // 把GC没标记的字符串从哈希表中删除
 void tableRemoveWhite(Table* table) {
+    if (table->count == 0)
+        return;
+
+    // 先收集再删除：回填式删除会移动entry，边遍历边删会漏掉被挪动的key。
+    // 临时数组不走reallocate，避免在GC路径上再触发GC
+    ObjString** white = (ObjString**)malloc(sizeof(ObjString*) * table->count);
+    if (white == NULL)
+        exit(1);
+    int whiteCount = 0;
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+        ObjString* key = table->keys[i];
+        if (key != NULL && !key->obj.isMarked) {
+            // minor GC不扫老年代，老年代字符串没被标记也不能删
+            if (vm.gcMinor && key->obj.isOld) {
+                continue;
+            }
+            white[whiteCount++] = key;
         }
     }
+    for (int i = 0; i < whiteCount; i++) {
+        tableDelete(table, white[i]);
+    }
+    free(white);
 }
 
 // GC 标记哈希表
 void markTable(Table* table) {
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+        markObject((Obj*)table->keys[i]);
+        markValue(table->values[i]);
     }
-}
\ No newline at end of file
+}
@@ -4,24 +4,23 @@
 #include "common.h"
 #include "value.h"
 
-// 哈希表的Entry定义
-typedef struct {
-    ObjString* key;  // key，字符串
-    Value value;     // value
-} Entry;
-
 /**
  * @brief 哈希表定义
- * lox的哈希表采用数组+开放性寻址（open addressing）来实现。
- * 根据key的hash值确定数组索引，每个索引只存一个entry。如果遇到冲突，则继续向期望索引的后面遍历，直到遇到的第一个空位置或者墓碑节点。
- * 删除key时，并不真的把相应位置的entry置为空，而是标记为墓碑节点（不这么做的话无法保证get方法的正确性）。墓碑节点可以被后面的set方法复用。此时count数量不减少，不然可能会出现全都是墓碑count=0的情况，findEntry永远在找非墓碑空节点。
- * 最大负载为0.75,达到时需要扩容。在扩容时会把墓碑节点的数量去掉。
- *
+ * lox的哈希表采用开放性寻址（open addressing）+ robin hood探测来实现。
+ * 数据拆成三个平行数组：紧凑的hash元数据数组先扫，比对上了才去碰key指针，
+ * 探测路径上基本只读元数据，缓存局部性比整个entry结构体排在一起好得多。
+ * 冲突时向后线性探测，robin hood规则保证「离理想位置越远的entry越靠后」，
+ * 查找时一旦遇到比自己离家近的entry就可以提前断定不存在。
+ * 删除采用回填（backward shift）：把后面还没回到理想位置的entry依次前移，
+ * 不留墓碑，长期运行也不会有墓碑堆积拖慢探测。
+ * 最大负载为0.75，达到时扩容。
  */
 typedef struct {
-    int count;       // 当前Entry个数
-    int capacity;    // 当前容量
-    Entry* entries;  // Entry数组
+    int count;         // 当前key个数
+    int capacity;      // 当前容量
+    uint32_t* hashes;  // 每个槽的key hash缓存，探测时先比这个
+    ObjString** keys;  // key数组，NULL代表空槽
+    Value* values;     // value数组
 } Table;
 
 // 初始化哈希表
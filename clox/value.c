@@ -34,6 +34,18 @@ void freeValueArray(ValueArray* array) {
  * @param value
  */
 void printValue(Value value) {
+#ifdef NAN_BOXING
+    // NaN boxing模式下没有type字段，按位模式逐个判断
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        printObject(value);
+    }
+#else
     switch (value.type) {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
@@ -48,6 +60,7 @@ void printValue(Value value) {
             printObject(value);
             break;
     }
+#endif
 }
 
 /**
@@ -59,6 +72,14 @@ void printValue(Value value) {
  * @return false
  */
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // 数字要走double比较，保证 NaN != NaN 的IEEE754语义
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    // 其余类型（包括interned的字符串）位模式相同即相等，一次整数比较搞定
+    return a == b;
+#else
     // 先判断类型是否一致
     if (a.type != b.type)
         return false;
@@ -75,4 +96,5 @@ bool valuesEqual(Value a, Value b) {
         default:
             return false;  // Unreachable.
     }
+#endif
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
@@ -15,6 +17,60 @@ typedef enum {
   VAL_OBJ
 } ValueType;
 
+#ifdef NAN_BOXING
+
+// NaN boxing表示法。
+// IEEE754的double中，指数位全1代表NaN，此时还剩51位尾数可以自由使用（除了最高位用于区分quiet
+// NaN）。 真实的数字直接按double的位存储；非数字的值都放在quiet
+// NaN（QNAN全1）里：
+//   - nil/true/false 用最低两位做标签
+//   - 对象指针借助符号位SIGN_BIT标识，x86-64/arm64的指针实际只有48位，放得下
+// 这样一个Value只占8个字节，相等判断退化成整数比较。
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+// nil/false/true的标签位
+#define TAG_NIL 1    // 01.
+#define TAG_FALSE 2  // 10.
+#define TAG_TRUE 3   // 11.
+
+typedef uint64_t Value;
+
+// 判断Value是否是指定的类型
+// 不是QNAN的位模式就是一个真实的double
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+// 从Value中取真实的值
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+// 将值包装成Value
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num) numToValue(num)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// double和uint64_t之间按位转换。memcpy会被编译器优化成一条mov指令。
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 // Value代表lox中的一个值
 typedef struct {
   ValueType type; // 值类型
@@ -42,6 +98,8 @@ typedef struct {
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+#endif
+
 // 定义值的动态数组
 typedef struct {
   int capacity;
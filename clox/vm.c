@@ -1,6 +1,6 @@
 #include <stdarg.h>
 #include <stdio.h>
-
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "common.h"
@@ -8,10 +8,18 @@
 #include "debug.h"
 #include "memory.h"
 #include "object.h"
+#include "profiler.h"
 #include "vm.h"
 
-// 虚拟机对象
-VM vm;
+// 函数调用到这个次数就算热函数，触发再优化
+#define HOT_FUNCTION_THRESHOLD 32
+
+// 每经过这么多个OP_LOOP回边，就轮转一次可运行的fiber，
+// 避免一个死循环的fiber饿死其他fiber
+#define FIBER_SWITCH_INTERVAL 64
+
+// 当前线程绑定的VM上下文，API入口负责设置。详见vm.h里的vm宏
+_Thread_local VM* vmCurrent = NULL;
 
 // clockNative函数
 static Value clockNative(int argCount, Value* args) {
@@ -25,7 +33,74 @@ static Value clockNative(int argCount, Value* args) {
 static void resetStack() {
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    memset(vm.openUpvalueSlots, 0, STACK_MAX * sizeof(ObjUpvalue*));
+    // 出错重置时把还在排队的fiber一并丢弃
+    vm.runHead = NULL;
+    vm.runTail = NULL;
+    vm.blockedChannel = NULL;
+    vm.switchBudget = FIBER_SWITCH_INTERVAL;
+}
+
+// 把fiber装载为当前执行状态。vm里的栈、帧等字段都改指向这个fiber的
+static void loadFiber(ObjFiber* fiber) {
+    vm.fiber = fiber;
+    vm.stack = fiber->stack;
+    vm.stackTop = fiber->stackTop;
+    vm.frames = fiber->frames;
+    vm.frameCount = fiber->frameCount;
+    vm.openUpvalueSlots = fiber->openUpvalueSlots;
+}
+
+// 把fiber挂到可运行队列尾部
+static void scheduleFiber(ObjFiber* fiber) {
+    fiber->next = NULL;
+    if (vm.runTail == NULL) {
+        vm.runHead = fiber;
+    } else {
+        vm.runTail->next = fiber;
+    }
+    vm.runTail = fiber;
+}
+
+// 切换到运行队列头部的fiber，当前fiber的执行状态先存回它自己的对象里。
+// 队列为空时返回false，当前fiber保持不变
+static bool switchToNext() {
+    if (vm.runHead == NULL) {
+        return false;
+    }
+    ObjFiber* next = vm.runHead;
+    vm.runHead = next->next;
+    if (vm.runHead == NULL) {
+        vm.runTail = NULL;
+    }
+    next->next = NULL;
+
+    vm.fiber->stackTop = vm.stackTop;
+    vm.fiber->frameCount = vm.frameCount;
+    loadFiber(next);
+    return true;
+}
+
+// receive等在了空channel上：把当前fiber挂到channel的等待队列尾部，
+// 切换到下一个可运行的fiber。没有可切换的返回false（所有fiber都在等，死锁）
+static bool suspendOnChannel() {
+    ObjChannel* channel = vm.blockedChannel;
+    vm.blockedChannel = NULL;
+
+    ObjFiber* fiber = vm.fiber;
+    fiber->next = NULL;
+    if (channel->waiting == NULL) {
+        channel->waiting = fiber;
+    } else {
+        ObjFiber* tail = channel->waiting;
+        while (tail->next != NULL) {
+            tail = tail->next;
+        }
+        tail->next = fiber;
+    }
+    // channel可能已在老年代，挂上去的fiber永远是年轻代对象
+    writeBarrier((Obj*)channel);
+    return switchToNext();
 }
 
 /**
@@ -46,7 +121,8 @@ static void runtimeError(const char* format, ...) {
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ",
+                getLine(&function->chunk, instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -57,41 +133,249 @@ static void runtimeError(const char* format, ...) {
     resetStack();
 }
 
+int vmGlobalSlot(ObjString* name) {
+    // 已经分配过槽的变量直接返回旧索引
+    Value slot;
+    if (tableGet(&vm.globalNames, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    // 槽用完了（24位操作数的上限），由编译器负责报错
+    if (vm.globalCount == GLOBALS_MAX) {
+        return -1;
+    }
+
+    // 槽数组按需扩容。扩容可能触发GC，此时name还没挂到任何根上，先压栈保护
+    if (vm.globalCapacity < vm.globalCount + 1) {
+        push(OBJ_VAL(name));
+        int oldCapacity = vm.globalCapacity;
+        vm.globalCapacity = GROW_CAPACITY(oldCapacity);
+        vm.globals = GROW_ARRAY(GlobalVar, vm.globals, oldCapacity,
+                                vm.globalCapacity);
+        pop();
+    }
+
+    // 分配一个新槽。先把name挂到槽上再写哈希表，
+    // 这样tableSet扩容触发GC时name已经是可达的了
+    int index = vm.globalCount++;
+    vm.globals[index].name = name;
+    vm.globals[index].value = NIL_VAL;
+    vm.globals[index].defined = false;
+    tableSet(&vm.globalNames, name, NUMBER_VAL(index));
+    return index;
+}
+
+// len(x)：列表的元素个数，或者字符串的长度
+static Value lenNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        return NUMBER_VAL(0);
+    }
+    if (IS_LIST(args[0])) {
+        return NUMBER_VAL(AS_LIST(args[0])->items.count);
+    }
+    if (IS_STRING(args[0])) {
+        return NUMBER_VAL(AS_STRING(args[0])->length);
+    }
+    if (IS_ROPE(args[0])) {
+        return NUMBER_VAL(AS_ROPE(args[0])->length);
+    }
+    return NUMBER_VAL(0);
+}
+
+// append(list, value)：往列表尾部追加一个元素，返回新长度
+static Value appendNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_LIST(args[0])) {
+        return NIL_VAL;
+    }
+    ObjList* list = AS_LIST(args[0]);
+    writeValueArray(&list->items, args[1]);
+    // 列表可能在老年代，新元素可能是年轻对象
+    writeBarrier((Obj*)list);
+    return NUMBER_VAL(list->items.count);
+}
+
+// gcstats()：把GC统计装进一个列表返回，脚本里可以自己做监控上报。
+// 依次是 [minor次数, major次数, 回收字节数, mark毫秒, trace毫秒,
+//        sweep毫秒, 峰值堆字节数]
+static Value gcstatsNative(int argCount, Value* args) {
+    ObjList* list = newList();
+    // 往列表里写元素可能触发GC，先把列表压栈当根
+    push(OBJ_VAL(list));
+    GCStats* stats = &vm.gcStats;
+    writeValueArray(&list->items, NUMBER_VAL(stats->minorCount));
+    writeValueArray(&list->items, NUMBER_VAL(stats->majorCount));
+    writeValueArray(&list->items, NUMBER_VAL((double)stats->bytesReclaimed));
+    writeValueArray(&list->items, NUMBER_VAL(stats->markTime * 1000));
+    writeValueArray(&list->items, NUMBER_VAL(stats->traceTime * 1000));
+    writeValueArray(&list->items, NUMBER_VAL(stats->sweepTime * 1000));
+    writeValueArray(&list->items, NUMBER_VAL((double)stats->peakBytes));
+    return pop();
+}
+
+// 创建一个channel。fiber之间通过它传值
+static Value channelNative(int argCount, Value* args) {
+    return OBJ_VAL(newChannel());
+}
+
+// spawn(closure)：把一个无参闭包铺到新fiber上并排进可运行队列。
+// 传的不是无参闭包时不产生fiber，返回nil
+static Value spawnNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_CLOSURE(args[0])) {
+        return NIL_VAL;
+    }
+    ObjClosure* closure = AS_CLOSURE(args[0]);
+    if (closure->function->arity != 0) {
+        return NIL_VAL;
+    }
+
+    // 在新fiber的栈上铺好初始调用帧，和interpretFunction启动脚本一个套路
+    ObjFiber* fiber = newFiber();
+    fiber->stack[0] = OBJ_VAL(closure);
+    fiber->stackTop = fiber->stack + 1;
+    CallFrame* frame = &fiber->frames[0];
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    frame->slots = fiber->stack;
+    fiber->frameCount = 1;
+
+    scheduleFiber(fiber);
+    return OBJ_VAL(fiber);
+}
+
+// send(channel, value)：往channel的队列里追加一个值，不阻塞。
+// 有fiber在等接收的话唤醒队头那一个
+static Value sendNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_CHANNEL(args[0])) {
+        return NIL_VAL;
+    }
+    ObjChannel* channel = AS_CHANNEL(args[0]);
+    writeValueArray(&channel->queue, args[1]);
+    // channel可能在老年代，刚写入的值可能是年轻对象
+    writeBarrier((Obj*)channel);
+
+    if (channel->waiting != NULL) {
+        ObjFiber* waiter = channel->waiting;
+        channel->waiting = waiter->next;
+        waiter->next = NULL;
+        scheduleFiber(waiter);
+    }
+    return NIL_VAL;
+}
+
+// receive(channel)：从channel队头取一个值。队列空时通过vm.blockedChannel
+// 告诉调用指令把当前fiber挂起，被send唤醒后会重新执行这一次receive
+static Value receiveNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_CHANNEL(args[0])) {
+        return NIL_VAL;
+    }
+    ObjChannel* channel = AS_CHANNEL(args[0]);
+    if (channel->head == channel->queue.count) {
+        vm.blockedChannel = channel;
+        return NIL_VAL;
+    }
+
+    Value value = channel->queue.values[channel->head++];
+    // 队列取空之后索引归零，数组空间复用
+    if (channel->head == channel->queue.count) {
+        channel->head = 0;
+        channel->queue.count = 0;
+    }
+    return value;
+}
+
 // 定义navtive函数
 static void defineNative(const char* name, NativeFn function) {
-    // push然后pop是确保GC不会在这期间回收这些字符串
+    // push然后pop是确保GC不会在这期间回收这些对象
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    // native函数和普通全局变量一样占一个全局槽
+    int slot = vmGlobalSlot(AS_STRING(vm.stack[0]));
+    vm.globals[slot].value = vm.stack[1];
+    vm.globals[slot].defined = true;
     pop();
     pop();
 }
 
-void initVM() {
-
-    resetStack();
+void initVM(VM* context) {
+    // 把上下文绑到当前线程，后面的初始化（包括分配initString）都作用在它上面
+    vmCurrent = context;
 
     vm.objects = NULL;
+    vm.oldObjects = NULL;
+
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
 
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;  // 默认GC触发值
+    vm.nextGC = 1024 * 1024;           // 默认minor GC触发值
+    vm.nextMajorGC = 4 * 1024 * 1024;  // 默认major GC触发值
+    vm.gcMinor = false;
+    vm.gcGrowFactor = 2.0;
+    memset(&vm.gcStats, 0, sizeof(GCStats));
+
+    // 长期运行的服务可以用环境变量调GC，不用重新编译：
+    // LOX_GC_HEAP设初始触发阈值（字节），LOX_GC_GROW设每轮后的增长倍数
+    const char* heapEnv = getenv("LOX_GC_HEAP");
+    if (heapEnv != NULL && atol(heapEnv) > 0) {
+        vm.nextGC = (size_t)atol(heapEnv);
+        vm.nextMajorGC = vm.nextGC * 4;  // 保持默认的1:4比例
+    }
+    const char* growEnv = getenv("LOX_GC_GROW");
+    if (growEnv != NULL && atof(growEnv) > 1.0) {
+        vm.gcGrowFactor = atof(growEnv);
+    }
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.parallelMarking = false;
+    vm.busyWorkers = 0;
+
+    // 内存池必须在第一次分配对象之前清空
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        vm.poolFree[i] = NULL;
+    }
+    vm.poolSlabs = NULL;
 
-    initTable(&vm.globals);
+    initTable(&vm.globalNames);
+    vm.globals = NULL;
+    vm.globalCount = 0;
+    vm.globalCapacity = 0;
+    vm.selectorCount = 0;
     initTable(&vm.strings);  // 初始化字符串缓存哈希表
 
+    // 主脚本也跑在一个fiber上（根fiber）。fiber分配可能触发GC，
+    // 上面的GC状态必须先就位
+    vm.fiber = NULL;
+    vm.runHead = NULL;
+    vm.runTail = NULL;
+    vm.allFibers = NULL;
+    vm.blockedChannel = NULL;
+    vm.switchBudget = FIBER_SWITCH_INTERVAL;
+    loadFiber(newFiber());
+    resetStack();
+
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
 
     defineNative("clock", clockNative);  // 定义一个native函数
-    
+    // fiber和channel相关的native
+    defineNative("spawn", spawnNative);
+    defineNative("channel", channelNative);
+    defineNative("send", sendNative);
+    defineNative("receive", receiveNative);
+    // 列表相关的native
+    defineNative("len", lenNative);
+    defineNative("append", appendNative);
+    // GC统计
+    defineNative("gcstats", gcstatsNative);
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
+void freeVM(VM* context) {
+    vmCurrent = context;
+    freeTable(&vm.globalNames);
+    FREE_ARRAY(GlobalVar, vm.globals, vm.globalCapacity);
     freeTable(&vm.strings);
     vm.initString = NULL;
     // 释放所有对象占用的内存
@@ -130,6 +414,14 @@ static bool call(ObjClosure* closure, int argCount) {
         return false;
     }
 
+    // 热函数升级：调用次数到达阈值时，对量化过的字节码再做一轮窥孔优化。
+    // 只在恰好等于阈值时做一次，之后不再计数
+    ObjFunction* function = closure->function;
+    if (function->callCount < HOT_FUNCTION_THRESHOLD &&
+        ++function->callCount == HOT_FUNCTION_THRESHOLD) {
+        optimizeFunction(function);
+    }
+
     // 创建一个新的帧，即要执行的函数的帧
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;                   // 帧绑定函数
@@ -175,6 +467,11 @@ static bool callValue(Value callee, int argCount) {
                 // native函数，直接调用，不用走VM执行
                 NativeFn native = AS_NATIVE(callee);
                 Value result = native(argCount, vm.stackTop - argCount);
+                // receive在空channel上等待：栈原样保留（含native和入参），
+                // 调用指令会把ip回退，fiber被唤醒后整个调用重来一遍
+                if (vm.blockedChannel != NULL) {
+                    return true;
+                }
                 // 把函数调用是用的参入从栈中清掉
                 vm.stackTop -= argCount + 1;
                 // 函数的结果放入栈
@@ -189,20 +486,47 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
-// 调用类的方法
-static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
-    Value method;
+// 按selector编号在类的vtable里找方法。名字没领过编号、编号超出
+// 这个类的vtable、或者槽位是空的都返回nil，让调用方走名字查表兜底
+static Value vtableLookup(ObjClass* klass, ObjString* name) {
+    int sel = name->selector;
+    if (sel >= 0 && sel < klass->vtableCapacity) {
+        return klass->vtable[sel];
+    }
+    return NIL_VAL;
+}
+
+// 调用类的方法。cache非空时会把解析结果填进调用点的内联缓存
+static bool invokeFromClass(ObjClass* klass,
+                            ObjString* name,
+                            int argCount,
+                            PropertyCache* cache) {
+    // 先按selector编号直接加载，热路径上不碰哈希表
+    Value method = vtableLookup(klass, name);
+    if (!IS_NIL(method)) {
+        if (cache != NULL) {
+            cache->klass = klass;
+            cache->method = method;
+        }
+        return call(AS_CLOSURE(method), argCount);
+    }
+
     // 获取方法函数体
     if (!tableGet(&klass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
+    // 记住这次的解析结果，同一个类下次直接命中
+    if (cache != NULL) {
+        cache->klass = klass;
+        cache->method = method;
+    }
     // 调用函数
     return call(AS_CLOSURE(method), argCount);
 }
 
 // 方法直接调用
-static bool invoke(ObjString* name, int argCount) {
+static bool invoke(ObjString* name, int argCount, PropertyCache* cache) {
     // 获取实例对象（中间隔了argCount个入参）
     Value receiver = peek(argCount);
     // 只有类实例可以调用方法
@@ -231,22 +555,34 @@ static bool invoke(ObjString* name, int argCount) {
         oops.field();
      *
      */
-    if (tableGet(&instance->fields, name, &value)) {
+    // 实例一个字段都没有时（方法调用为主的类的常态）连这次探测也省掉
+    if (instance->fields.count > 0 &&
+        tableGet(&instance->fields, name, &value)) {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    // 单态命中：这个调用点上次见到的就是同一个类，直接用缓存的方法
+    if (cache != NULL && cache->klass == instance->klass) {
+        return call(AS_CLOSURE(cache->method), argCount);
+    }
+
+    return invokeFromClass(instance->klass, name, argCount, cache);
 }
 
-// 将函数绑定到实例呢
-static bool bindMethod(ObjClass* klass, ObjString* name) {
-    Value method;
-    // 先获取类的方法对象
-    if (!tableGet(&klass->methods, name, &method)) {
+// 将函数绑定到实例呢。cache非空时会把解析结果填进访问点的内联缓存
+static bool bindMethod(ObjClass* klass, ObjString* name, PropertyCache* cache) {
+    // 和invokeFromClass一样先走vtable
+    Value method = vtableLookup(klass, name);
+    if (IS_NIL(method) && !tableGet(&klass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
+    // 记住这次的解析结果，同一个类下次直接命中
+    if (cache != NULL) {
+        cache->klass = klass;
+        cache->method = method;
+    }
     // 将实例peek出来，和方法绑定到一起
     ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
     pop();                 // 类实例pop出来
@@ -254,52 +590,70 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
     return true;
 }
 
-// 通过本地变量获取闭包变量
+// 通过本地变量获取闭包变量。按栈槽索引直达，O(1)
 static ObjUpvalue* captureUpvalue(Value* local) {
-    ObjUpvalue* prevUpvalue = NULL;
-    // 遍历VM中的所有闭包变量，查看local是否存在
-    ObjUpvalue* upvalue = vm.openUpvalues;
-    while (upvalue != NULL && upvalue->location > local) {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
-    }
-    // 存在直接返回
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
-    }
-    // 创建一个新的ObjUpvalue
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
-    // 根据location的值，放到链表中正确的位置
-    createdUpvalue->next = upvalue;
-
-    if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
-    } else {
-        prevUpvalue->next = createdUpvalue;
+    int slot = (int)(local - vm.stack);
+    // 这个槽已经有打开的upvalue，直接共享
+    if (vm.openUpvalueSlots[slot] != NULL) {
+        return vm.openUpvalueSlots[slot];
     }
+    // 创建一个新的ObjUpvalue，登记到槽表上
+    ObjUpvalue* createdUpvalue = newUpvalue(local);
+    vm.openUpvalueSlots[slot] = createdUpvalue;
     return createdUpvalue;
 }
 
-// 把值从栈上转移到heap上
+// 把值从栈上转移到heap上。只扫描[last, stackTop)这段要被丢弃的窗口
 static void closeUpvalues(Value* last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
+    for (Value* slot = last; slot < vm.stackTop; slot++) {
+        ObjUpvalue* upvalue = vm.openUpvalueSlots[slot - vm.stack];
+        if (upvalue == NULL) {
+            continue;
+        }
         // 把location指向的值（原本在栈中）转移到closed字段
         upvalue->closed = *upvalue->location;
         // 再把指针赋给location。现在location指向的值在heap中了
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        // 值从栈转移进了upvalue对象里，相当于一次对象写入
+        writeBarrier((Obj*)upvalue);
+        vm.openUpvalueSlots[slot - vm.stack] = NULL;
     }
 }
 
-// 定义方法
-static void defineMethod(ObjString* name) {
-    // 方法对象
-    Value method = peek(0);
-    // 类对象
-    ObjClass* klass = AS_CLASS(peek(1));
+// 把方法写进类vtable的sel号槽，容量不够就扩容，新槽填nil
+static void vtableStore(ObjClass* klass, int sel, Value method) {
+    if (sel >= klass->vtableCapacity) {
+        int oldCapacity = klass->vtableCapacity;
+        int newCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+        while (newCapacity <= sel) {
+            newCapacity *= 2;
+        }
+        klass->vtable =
+            GROW_ARRAY(Value, klass->vtable, oldCapacity, newCapacity);
+        for (int i = oldCapacity; i < newCapacity; i++) {
+            klass->vtable[i] = NIL_VAL;
+        }
+        klass->vtableCapacity = newCapacity;
+    }
+    klass->vtable[sel] = method;
+}
+
+void vmAddMethod(ObjClass* klass, ObjString* name, Value method) {
     // 方法绑定到类的哈希表中
     tableSet(&klass->methods, name, method);
+    // 这个名字第一次当方法名用就给它领一个selector编号，
+    // 然后把方法摊进vtable，调用时按编号一次加载直达
+    if (name->selector < 0) {
+        name->selector = vm.selectorCount++;
+    }
+    vtableStore(klass, name->selector, method);
+    writeBarrier((Obj*)klass);
+}
+
+// 定义方法
+static void defineMethod(ObjString* name) {
+    // 方法对象在栈顶，类对象在它下面
+    vmAddMethod(AS_CLASS(peek(1)), name, peek(0));
     // 方法对象pop出来
     pop();
 }
@@ -308,18 +662,39 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// 拼接结果达到这个长度才挂rope节点，短字符串直接拷贝更划算
+#define ROPE_MIN_LENGTH 32
+
+// 操作数（string或rope）的字符长度
+static int stringValueLength(Value value) {
+    return IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length;
+}
+
 // 字符串连接操作
 static void concatenate() {
-    // 先取出两个字符串对象
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
-    // 计算新的长度
-    int length = a->length + b->length;
+    // 两个操作数可能是string也可能是之前拼出来的rope，先peek不pop，防GC
+    Value b = peek(0);
+    Value a = peek(1);
+    int length = stringValueLength(a) + stringValueLength(b);
+
+    // 长字符串或者继续往rope上拼：只挂一个O(1)的拼接节点。
+    // 循环里拼大字符串从平方级拷贝变成线性，用到内容时才摊平
+    if (IS_ROPE(a) || IS_ROPE(b) || length >= ROPE_MIN_LENGTH) {
+        ObjRope* rope = newRope(a, b, length);
+        pop();
+        pop();
+        push(OBJ_VAL(rope));
+        return;
+    }
+
+    // 短字符串直接拷贝，挂节点的开销反而不值
+    ObjString* bs = AS_STRING(b);
+    ObjString* as = AS_STRING(a);
     // 开辟新的字符数组空间
     char* chars = ALLOCATE(char, length + 1);
     // 依次将两个字符串拷贝到新字符串
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
+    memcpy(chars, as->chars, as->length);
+    memcpy(chars + as->length, bs->chars, bs->length);
     chars[length] = '\0';
     // 用新字符串生成ObjString
     ObjString* result = takeString(chars, length);
@@ -347,6 +722,15 @@ static InterpretResult run() {
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
+// 读取24位大端常量索引对应的常量，_LONG系列指令用
+#define READ_CONSTANT_LONG()                                         \
+    (frame->ip += 3,                                                 \
+     frame->closure->function->chunk.constants                       \
+         .values[(frame->ip[-3] << 16) | (frame->ip[-2] << 8) |      \
+                 frame->ip[-1]])
+
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+
 // 二元操作的宏。先出栈两个元素，再执行op。
 // 定义为do while 是为了方便后面加分号
 #define BINARY_OP(valueType, op)                          \
@@ -360,115 +744,366 @@ static InterpretResult run() {
         push(valueType(a op b));                          \
     } while (false)
 
-    // 依次执行chunk中的指令
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
+// 执行每条指令前打印出执行栈中的所有元素和将要执行的指令，方便调试。
+// ip存的是指针地址，ip - chunk->code 代表下一个指令在code数组中的offset
+#define TRACE_EXECUTION()                                              \
+    do {                                                               \
+        printf("          ");                                          \
+        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {     \
+            printf("[ ");                                              \
+            printValue(*slot);                                         \
+            printf(" ]");                                              \
+        }                                                              \
+        printf("\n");                                                  \
+        disassembleInstruction(                                        \
+            &frame->closure->function->chunk,                          \
+            (int)(frame->ip - frame->closure->function->chunk.code));  \
+    } while (false)
+#else
+#define TRACE_EXECUTION() \
+    do {                  \
+    } while (false)
+#endif
 
-        // 执行前打印出执行栈中的所有元素，方便调试
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
+// --profile时记录将要执行的opcode（frame->ip此刻指向下一条指令），
+// 顺带给定时器采样提供一个安全点。未开启时只是一个可预测的分支
+#define PROFILE_INSTRUCTION()             \
+    do {                                  \
+        if (profilerActive) {             \
+            profilerRecord(frame->ip[0]); \
+        }                                 \
+    } while (false)
 
-        // debug模式每次输出要执行的指令。 ip存的是指针地址，vm.ip -
-        // vm.chunk->code 代表下一个指令在code数组中的offset
-        disassembleInstruction(
-            &frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
+    uint8_t instruction;
+
+#ifdef THREADED_DISPATCH
+// 线索化分发。CASE展开为label，DISPATCH_NEXT读取下一条指令后直接goto对应label。
+#define CASE(name) label_##name
+#define DISPATCH_NEXT()                                 \
+    do {                                                \
+        TRACE_EXECUTION();                              \
+        PROFILE_INSTRUCTION();                          \
+        goto* dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+
+    // 静态label表，按opcode索引。必须覆盖chunk.h中的每一个OpCode。
+    static void* dispatchTable[] = {
+        [OP_CONSTANT] = &&label_OP_CONSTANT,
+        [OP_NIL] = &&label_OP_NIL,
+        [OP_TRUE] = &&label_OP_TRUE,
+        [OP_FALSE] = &&label_OP_FALSE,
+        [OP_POP] = &&label_OP_POP,
+        [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&label_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&label_OP_SET_PROPERTY,
+        [OP_EQUAL] = &&label_OP_EQUAL,
+        [OP_GET_SUPER] = &&label_OP_GET_SUPER,
+        [OP_GREATER] = &&label_OP_GREATER,
+        [OP_LESS] = &&label_OP_LESS,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+        [OP_DIVIDE] = &&label_OP_DIVIDE,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_NEGATE] = &&label_OP_NEGATE,
+        [OP_PRINT] = &&label_OP_PRINT,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&label_OP_LOOP,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+        [OP_INVOKE] = &&label_OP_INVOKE,
+        [OP_SUPER_INVOKE] = &&label_OP_SUPER_INVOKE,
+        [OP_CLOSURE] = &&label_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&label_OP_RETURN,
+        [OP_CLASS] = &&label_OP_CLASS,
+        [OP_INHERIT] = &&label_OP_INHERIT,
+        [OP_METHOD] = &&label_OP_METHOD,
+        [OP_NOP] = &&label_OP_NOP,
+        [OP_GET_LOCAL2] = &&label_OP_GET_LOCAL2,
+        [OP_NOT_EQUAL] = &&label_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&label_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&label_OP_LESS_EQUAL,
+        [OP_CONSTANT_ADD] = &&label_OP_CONSTANT_ADD,
+        [OP_ADD_NUMBER] = &&label_OP_ADD_NUMBER,
+        [OP_ADD_STRING] = &&label_OP_ADD_STRING,
+        [OP_SUBTRACT_NUMBER] = &&label_OP_SUBTRACT_NUMBER,
+        [OP_MULTIPLY_NUMBER] = &&label_OP_MULTIPLY_NUMBER,
+        [OP_DIVIDE_NUMBER] = &&label_OP_DIVIDE_NUMBER,
+        [OP_CONSTANT_LONG] = &&label_OP_CONSTANT_LONG,
+        [OP_CLOSURE_LONG] = &&label_OP_CLOSURE_LONG,
+        [OP_GET_GLOBAL_LONG] = &&label_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL_LONG] = &&label_OP_DEFINE_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG] = &&label_OP_SET_GLOBAL_LONG,
+        [OP_GET_PROPERTY_LONG] = &&label_OP_GET_PROPERTY_LONG,
+        [OP_SET_PROPERTY_LONG] = &&label_OP_SET_PROPERTY_LONG,
+        [OP_INVOKE_LONG] = &&label_OP_INVOKE_LONG,
+        [OP_GET_SUPER_LONG] = &&label_OP_GET_SUPER_LONG,
+        [OP_SUPER_INVOKE_LONG] = &&label_OP_SUPER_INVOKE_LONG,
+        [OP_CLASS_LONG] = &&label_OP_CLASS_LONG,
+        [OP_METHOD_LONG] = &&label_OP_METHOD_LONG,
+        [OP_BUILD_LIST] = &&label_OP_BUILD_LIST,
+        [OP_GET_INDEX] = &&label_OP_GET_INDEX,
+        [OP_SET_INDEX] = &&label_OP_SET_INDEX,
+    };
+
+    // 启动分发，读取第一条指令
+    DISPATCH_NEXT();
+#else
+// 可移植的switch分发。CASE展开为普通的case，DISPATCH_NEXT回到loop开头。
+#define CASE(name) case name
+#define DISPATCH_NEXT() break
 
-        uint8_t instruction;
+    // 依次执行chunk中的指令
+    for (;;) {
+        TRACE_EXECUTION();
+        PROFILE_INSTRUCTION();
         // 每次从frame中读取一个指令
         switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
+#endif
+        {
+            CASE(OP_CONSTANT) : {
                 // 常量指令，再读取后面常量值
                 Value constant = READ_CONSTANT();
                 // printValue(constant);
                 // printf("\n");
                 // 值入栈
                 push(constant);
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_NIL:
+            CASE(OP_NIL) :
                 push(NIL_VAL);
-                break;
-            case OP_TRUE:
+                DISPATCH_NEXT();
+            CASE(OP_TRUE) :
                 push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
+                DISPATCH_NEXT();
+            CASE(OP_FALSE) :
                 push(BOOL_VAL(false));
-                break;
-            case OP_POP:
+                DISPATCH_NEXT();
+            CASE(OP_POP) :
                 pop();
-                break;
-            case OP_GET_LOCAL: {
+                DISPATCH_NEXT();
+            CASE(OP_GET_LOCAL) : {
                 // 本地变量取值，下一个指令就是本地变量值在chunk中的索引
                 uint8_t slot = READ_BYTE();
                 // 将值push进栈
                 push(frame->slots[slot]);
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_SET_LOCAL: {
+            CASE(OP_SET_LOCAL) : {
                 // 本地变量赋值，下一个指令就是本地变量值在栈中的索引
                 uint8_t slot = READ_BYTE();
                 // 将索引位置的值修改。这里用peek是因为表达式后面统一都跟了一个pop，会统一把值弹出，清空栈。
                 frame->slots[slot] = peek(0);
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_GET_GLOBAL: {
-                // 全局变量获取
-                // 获取变量名
-                ObjString* name = READ_STRING();
-                Value value;
-                // 如果是没取到值，报错
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
+            CASE(OP_GET_GLOBAL) : {
+                // 全局变量获取，后面跟的是编译期解析好的槽索引
+                GlobalVar* global = &vm.globals[READ_BYTE()];
+                // 引用了还没定义的变量，报错
+                if (!global->defined) {
+                    runtimeError("Undefined variable '%s'.",
+                                 global->name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 // 把值放到栈中
-                push(value);
-                break;
+                push(global->value);
+                DISPATCH_NEXT();
             }
-            case OP_DEFINE_GLOBAL: {
-                // 全局变量定义
-                // 获取变量名称
-                ObjString* name = READ_STRING();
-                // 将变量放入全局变量集合
-                tableSet(&vm.globals, name, peek(0));
-                // 把变量的value pop()出来，后面会通过变量名从全局变量中获取
+            CASE(OP_DEFINE_GLOBAL) : {
+                // 全局变量定义，直接写入槽
+                GlobalVar* global = &vm.globals[READ_BYTE()];
+                global->value = peek(0);
+                global->defined = true;
+                // 把变量的value pop()出来，后面会通过槽索引从全局变量中获取
                 // 这里pop是因为变量定义属于声明，不是表达式，不会统一在后面加POP指令
                 pop();
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_SET_GLOBAL: {
-                // 全局变量取值
-                // 读取变量名
-                ObjString* name = READ_STRING();
-                // 试图赋值，如果是第一次赋值，说名变量还没定义过，需要报错
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
+            CASE(OP_SET_GLOBAL) : {
+                // 全局变量赋值
+                GlobalVar* global = &vm.globals[READ_BYTE()];
+                // 如果是第一次赋值，说名变量还没定义过，需要报错
+                if (!global->defined) {
+                    runtimeError("Undefined variable '%s'.",
+                                 global->name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                global->value = peek(0);
                 // 赋值不对栈产生任何影响。栈里的值会在expressionStatement() 里加的POP指令被pop出来
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_SET_UPVALUE: {
+            CASE(OP_GET_GLOBAL_LONG) : {
+                // 和OP_GET_GLOBAL一样，只是槽索引是24位大端的
+                int slot = READ_BYTE();
+                slot = (slot << 8) | READ_BYTE();
+                slot = (slot << 8) | READ_BYTE();
+                GlobalVar* global = &vm.globals[slot];
+                if (!global->defined) {
+                    runtimeError("Undefined variable '%s'.",
+                                 global->name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                push(global->value);
+                DISPATCH_NEXT();
+            }
+            CASE(OP_DEFINE_GLOBAL_LONG) : {
+                // 和OP_DEFINE_GLOBAL一样，只是槽索引是24位大端的
+                int slot = READ_BYTE();
+                slot = (slot << 8) | READ_BYTE();
+                slot = (slot << 8) | READ_BYTE();
+                GlobalVar* global = &vm.globals[slot];
+                global->value = peek(0);
+                global->defined = true;
+                pop();
+                DISPATCH_NEXT();
+            }
+            CASE(OP_SET_GLOBAL_LONG) : {
+                // 和OP_SET_GLOBAL一样，只是槽索引是24位大端的
+                int slot = READ_BYTE();
+                slot = (slot << 8) | READ_BYTE();
+                slot = (slot << 8) | READ_BYTE();
+                GlobalVar* global = &vm.globals[slot];
+                if (!global->defined) {
+                    runtimeError("Undefined variable '%s'.",
+                                 global->name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                global->value = peek(0);
+                DISPATCH_NEXT();
+            }
+            CASE(OP_GET_PROPERTY_LONG) : {
+                // 和OP_GET_PROPERTY一样，只是名字索引是24位大端的
+                if (!IS_INSTANCE(peek(0))) {
+                    runtimeError("Only instances have properties.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjInstance* instance = AS_INSTANCE(peek(0));
+                ObjString* name = READ_STRING_LONG();
+                uint8_t cacheSlot = READ_BYTE();
+                PropertyCache* cache =
+                    cacheSlot == CACHE_NONE
+                        ? NULL
+                        : &frame->closure->function->chunk.caches[cacheSlot];
+
+                if (instance->fields.count > 0) {
+                    Value value;
+                    if (tableGet(&instance->fields, name, &value)) {
+                        pop();
+                        push(value);
+                        DISPATCH_NEXT();
+                    }
+                }
+
+                if (cache != NULL && cache->klass == instance->klass) {
+                    ObjBoundMethod* bound =
+                        newBoundMethod(peek(0), AS_CLOSURE(cache->method));
+                    pop();
+                    push(OBJ_VAL(bound));
+                    DISPATCH_NEXT();
+                }
+
+                if (cache != NULL) {
+                    writeBarrier((Obj*)frame->closure->function);
+                }
+                if (!bindMethod(instance->klass, name, cache)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                DISPATCH_NEXT();
+            }
+            CASE(OP_SET_PROPERTY_LONG) : {
+                // 和OP_SET_PROPERTY一样，只是名字索引是24位大端的
+                if (!IS_INSTANCE(peek(1))) {
+                    runtimeError("Only instances have fields.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjInstance* instance = AS_INSTANCE(peek(1));
+                tableSet(&instance->fields, READ_STRING_LONG(), peek(0));
+                writeBarrier((Obj*)instance);
+                Value value = pop();
+                pop();
+                push(value);
+                DISPATCH_NEXT();
+            }
+            CASE(OP_INVOKE_LONG) : {
+                // 和OP_INVOKE一样，只是方法名索引是24位大端的
+                ObjString* method = READ_STRING_LONG();
+                int argCount = READ_BYTE();
+                uint8_t cacheSlot = READ_BYTE();
+                PropertyCache* cache =
+                    cacheSlot == CACHE_NONE
+                        ? NULL
+                        : &frame->closure->function->chunk.caches[cacheSlot];
+                if (cache != NULL) {
+                    writeBarrier((Obj*)frame->closure->function);
+                }
+                if (!invoke(method, argCount, cache)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // 被channel挂起时重放本条指令，宽版指令长6字节
+                if (vm.blockedChannel != NULL) {
+                    frame->ip -= 6;
+                    if (!suspendOnChannel()) {
+                        runtimeError("All fibers are blocked.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame = &vm.frames[vm.frameCount - 1];
+                    DISPATCH_NEXT();
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                DISPATCH_NEXT();
+            }
+            CASE(OP_GET_SUPER_LONG) : {
+                // 和OP_GET_SUPER一样，只是方法名索引是24位大端的
+                ObjString* name = READ_STRING_LONG();
+                ObjClass* superclass = AS_CLASS(pop());
+                if (!bindMethod(superclass, name, NULL)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                DISPATCH_NEXT();
+            }
+            CASE(OP_SUPER_INVOKE_LONG) : {
+                // 和OP_SUPER_INVOKE一样，只是方法名索引是24位大端的
+                ObjString* method = READ_STRING_LONG();
+                int argCount = READ_BYTE();
+                ObjClass* superclass = AS_CLASS(pop());
+                if (!invokeFromClass(superclass, method, argCount, NULL)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                DISPATCH_NEXT();
+            }
+            CASE(OP_CLASS_LONG) :
+                // 和OP_CLASS一样，只是类名索引是24位大端的
+                push(OBJ_VAL(newClass(READ_STRING_LONG())));
+                DISPATCH_NEXT();
+            CASE(OP_METHOD_LONG) :
+                // 和OP_METHOD一样，只是方法名索引是24位大端的
+                defineMethod(READ_STRING_LONG());
+                DISPATCH_NEXT();
+            CASE(OP_SET_UPVALUE) : {
                 // 修改闭包变量
                 uint8_t slot = READ_BYTE();
                 *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                // 闭包变量关闭后值存在upvalue对象里，需要写屏障
+                writeBarrier((Obj*)frame->closure->upvalues[slot]);
+                DISPATCH_NEXT();
             }
-            case OP_GET_UPVALUE: {
+            CASE(OP_GET_UPVALUE) : {
                 // 获取闭包变量
                 uint8_t slot = READ_BYTE();
                 push(*frame->closure->upvalues[slot]->location);
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_GET_PROPERTY: {
+            CASE(OP_GET_PROPERTY) : {
                 // 如果.前面不是对象实例，不能获取
                 if (!IS_INSTANCE(peek(0))) {
                     runtimeError("Only instances have properties.");
@@ -479,23 +1114,45 @@ static InterpretResult run() {
                 ObjInstance* instance = AS_INSTANCE(peek(0));
                 // 字段名
                 ObjString* name = READ_STRING();
+                // 这个访问点的内联缓存。CACHE_NONE代表该点没分到缓存槽
+                uint8_t cacheSlot = READ_BYTE();
+                PropertyCache* cache =
+                    cacheSlot == CACHE_NONE
+                        ? NULL
+                        : &frame->closure->function->chunk.caches[cacheSlot];
 
-                Value value;
-                // 从实例的字段哈希表中获取字段值
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop();        // 把栈中的对象实例pop出去
-                    push(value);  // 把字段值放进去
-                    break;
+                // 从实例的字段哈希表中获取字段值。字段可能遮蔽同名方法，必须先查。
+                // 实例一个字段都没有时跳过哈希探测。
+                if (instance->fields.count > 0) {
+                    Value value;
+                    if (tableGet(&instance->fields, name, &value)) {
+                        pop();        // 把栈中的对象实例pop出去
+                        push(value);  // 把字段值放进去
+                        DISPATCH_NEXT();
+                    }
                 }
 
+                // 单态命中：这个访问点上次解析的就是同一个类，跳过方法表探测
+                if (cache != NULL && cache->klass == instance->klass) {
+                    ObjBoundMethod* bound =
+                        newBoundMethod(peek(0), AS_CLOSURE(cache->method));
+                    pop();
+                    push(OBJ_VAL(bound));
+                    DISPATCH_NEXT();
+                }
+
+                // 缓存内容存在函数对象的chunk里，填充前做一次写屏障
+                if (cache != NULL) {
+                    writeBarrier((Obj*)frame->closure->function);
+                }
                 // 如果字段没获取到，尝试获取方法。这里需要把类实例和方法体绑定起来。
-                if (!bindMethod(instance->klass, name)) {
+                if (!bindMethod(instance->klass, name, cache)) {
                     // 方法也获取不到抛出异常
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_SET_PROPERTY: {
+            CASE(OP_SET_PROPERTY) : {
                 if (!IS_INSTANCE(peek(1))) {
                     runtimeError("Only instances have fields.");
                     return INTERPRET_RUNTIME_ERROR;
@@ -505,96 +1162,240 @@ static InterpretResult run() {
                 ObjInstance* instance = AS_INSTANCE(peek(1));
                 // 设置字段值到哈希表
                 tableSet(&instance->fields, READ_STRING(), peek(0));
+                // 老年代实例里可能被写入了年轻对象，进记忆集
+                writeBarrier((Obj*)instance);
                 // 把对象实例pop出去，赋的值留在栈里。（后面会表达式被统一的pop移除）
                 Value value = pop();
                 pop();
                 push(value);
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_GET_SUPER: {
+            CASE(OP_GET_SUPER) : {
                 // 方法名
                 ObjString* name = READ_STRING();
                 // 父类对象，此时还在栈顶
                 ObjClass* superclass = AS_CLASS(pop());
                 // 从父类中找到方法，然后绑定到子类实例上
-                if (!bindMethod(superclass, name)) {
+                if (!bindMethod(superclass, name, NULL)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_EQUAL: {
+            CASE(OP_EQUAL) : {
+                // rope要先摊平成interned的字符串，不然和相同内容的字符串
+                // 做指针比较会失真。摊平会分配内存，必须趁操作数还在栈上做
+                if (IS_ROPE(peek(0))) {
+                    vm.stackTop[-1] = OBJ_VAL(ropeFlatten(AS_ROPE(peek(0))));
+                }
+                if (IS_ROPE(peek(1))) {
+                    vm.stackTop[-2] = OBJ_VAL(ropeFlatten(AS_ROPE(peek(1))));
+                }
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_GREATER:
+            CASE(OP_GREATER) :
                 BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS:
+                DISPATCH_NEXT();
+            CASE(OP_LESS) :
                 BINARY_OP(BOOL_VAL, <);
-                break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    // 字符串相加
+                DISPATCH_NEXT();
+            CASE(OP_NOT_EQUAL) : {
+                // OP_EQUAL + OP_NOT 的合并。rope同样要先摊平再比较
+                if (IS_ROPE(peek(0))) {
+                    vm.stackTop[-1] = OBJ_VAL(ropeFlatten(AS_ROPE(peek(0))));
+                }
+                if (IS_ROPE(peek(1))) {
+                    vm.stackTop[-2] = OBJ_VAL(ropeFlatten(AS_ROPE(peek(1))));
+                }
+                Value b = pop();
+                Value a = pop();
+                push(BOOL_VAL(!valuesEqual(a, b)));
+                DISPATCH_NEXT();
+            }
+            CASE(OP_GREATER_EQUAL) : {
+                // OP_LESS + OP_NOT 的合并。写成!(a<b)保持NaN语义和原指令一致
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    runtimeError("Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(BOOL_VAL(!(a < b)));
+                DISPATCH_NEXT();
+            }
+            CASE(OP_LESS_EQUAL) : {
+                // OP_GREATER + OP_NOT 的合并
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    runtimeError("Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(BOOL_VAL(!(a > b)));
+                DISPATCH_NEXT();
+            }
+            CASE(OP_CONSTANT_ADD) : {
+                // OP_CONSTANT + OP_ADD 的合并：常量入栈后立刻做加法。
+                // 这里不做量化，改写ip[-1]会踩到自己的常量操作数
+                push(READ_CONSTANT());
+                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    double b = AS_NUMBER(pop());
+                    double a = AS_NUMBER(pop());
+                    push(NUMBER_VAL(a + b));
+                } else if ((IS_STRING(peek(0)) || IS_ROPE(peek(0))) &&
+                           (IS_STRING(peek(1)) || IS_ROPE(peek(1)))) {
                     concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                } else {
+                    runtimeError(
+                        "Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                DISPATCH_NEXT();
+            }
+            CASE(OP_ADD) : {
+                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    // 量化：这个位置见到的是数字加法，改写成免类型分支的版本
+                    frame->ip[-1] = OP_ADD_NUMBER;
                     double b = AS_NUMBER(pop());
                     double a = AS_NUMBER(pop());
                     push(NUMBER_VAL(a + b));
+                } else if ((IS_STRING(peek(0)) || IS_ROPE(peek(0))) &&
+                           (IS_STRING(peek(1)) || IS_ROPE(peek(1)))) {
+                    // 字符串（或rope）相加，同样量化
+                    frame->ip[-1] = OP_ADD_STRING;
+                    concatenate();
                 } else {
                     runtimeError(
                         "Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_SUBTRACT:
+            CASE(OP_ADD_NUMBER) : {
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    // 赌输了：出现非数字，去优化回通用指令重新执行
+                    frame->ip[-1] = OP_ADD;
+                    frame->ip--;
+                    DISPATCH_NEXT();
+                }
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+                DISPATCH_NEXT();
+            }
+            CASE(OP_ADD_STRING) : {
+                if ((!IS_STRING(peek(0)) && !IS_ROPE(peek(0))) ||
+                    (!IS_STRING(peek(1)) && !IS_ROPE(peek(1)))) {
+                    // 去优化回通用指令重新执行
+                    frame->ip[-1] = OP_ADD;
+                    frame->ip--;
+                    DISPATCH_NEXT();
+                }
+                concatenate();
+                DISPATCH_NEXT();
+            }
+            CASE(OP_SUBTRACT) :
+                // 量化：首次确认是数字后改写成免检查的专用指令
+                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    frame->ip[-1] = OP_SUBTRACT_NUMBER;
+                }
                 BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
+                DISPATCH_NEXT();
+            CASE(OP_SUBTRACT_NUMBER) : {
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    frame->ip[-1] = OP_SUBTRACT;
+                    frame->ip--;
+                    DISPATCH_NEXT();
+                }
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a - b));
+                DISPATCH_NEXT();
+            }
+            CASE(OP_MULTIPLY) :
+                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    frame->ip[-1] = OP_MULTIPLY_NUMBER;
+                }
                 BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
+                DISPATCH_NEXT();
+            CASE(OP_MULTIPLY_NUMBER) : {
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    frame->ip[-1] = OP_MULTIPLY;
+                    frame->ip--;
+                    DISPATCH_NEXT();
+                }
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a * b));
+                DISPATCH_NEXT();
+            }
+            CASE(OP_DIVIDE) :
+                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    frame->ip[-1] = OP_DIVIDE_NUMBER;
+                }
                 BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_NOT:
+                DISPATCH_NEXT();
+            CASE(OP_DIVIDE_NUMBER) : {
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    frame->ip[-1] = OP_DIVIDE;
+                    frame->ip--;
+                    DISPATCH_NEXT();
+                }
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a / b));
+                DISPATCH_NEXT();
+            }
+            CASE(OP_NOT) :
                 push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE:
+                DISPATCH_NEXT();
+            CASE(OP_NEGATE) :
                 if (!IS_NUMBER(peek(0))) {
                     runtimeError("Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT: {
-                printValue(pop());
+                DISPATCH_NEXT();
+            CASE(OP_PRINT) : {
+                // 先peek后pop：打印rope会触发摊平分配，值得留在栈上防GC
+                printValue(peek(0));
+                pop();
                 printf("\n");
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_JUMP: {
+            CASE(OP_JUMP) : {
                 // 无条件跳转
                 // 后面的指令是要跳转的指令数量，读取之后，ip直接 +
                 // offset。这样就跳过了offset个指令
                 uint16_t offset = READ_SHORT();
                 frame->ip += offset;
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_JUMP_IF_FALSE: {
+            CASE(OP_JUMP_IF_FALSE) : {
                 // 有条件跳转，如果栈顶元素是false，则跳过一定数量的ip。否则不跳转。
                 uint16_t offset = READ_SHORT();
                 if (isFalsey(peek(0)))
                     frame->ip += offset;
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_LOOP: {
+            CASE(OP_LOOP) : {
                 // 循环跳转，即向前跳转offset个指令数量，即重新从前面一个位置开始执行，这样就做到的循环的效果。
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
-                break;
+                // 循环回边是fiber的轮转点：预算用完且有fiber在排队就让出
+                if (--vm.switchBudget == 0) {
+                    vm.switchBudget = FIBER_SWITCH_INTERVAL;
+                    if (vm.runHead != NULL) {
+                        scheduleFiber(vm.fiber);
+                        switchToNext();
+                        frame = &vm.frames[vm.frameCount - 1];
+                    }
+                }
+                DISPATCH_NEXT();
             }
-            case OP_CALL: {
+            CASE(OP_CALL) : {
                 // 函数执行
                 // 后面跟的是入参数量，读取出来
                 int argCount = READ_BYTE();
@@ -602,25 +1403,101 @@ static InterpretResult run() {
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                if (vm.blockedChannel != NULL) {
+                    // receive在空channel上等待。回退到OP_CALL本身（2字节），
+                    // 挂起当前fiber，被唤醒后重新执行这次调用
+                    frame->ip -= 2;
+                    if (!suspendOnChannel()) {
+                        runtimeError("All fibers are blocked.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame = &vm.frames[vm.frameCount - 1];
+                    DISPATCH_NEXT();
+                }
                 // callValue()
                 // 会创建一个新的frame，将它赋给当前frame，这样下一轮loop就会执行函数中的指令。
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_INVOKE: {
+            CASE(OP_TAIL_CALL) : {
+                // 尾调用：被调用者的返回值就是当前函数的返回值，
+                // 当前帧用不到了，直接复用，递归深度不再受FRAMES_MAX限制
+                int argCount = READ_BYTE();
+                Value callee = peek(argCount);
+                if (IS_CLOSURE(callee) &&
+                    AS_CLOSURE(callee)->function->arity == argCount) {
+                    ObjClosure* closure = AS_CLOSURE(callee);
+                    // 帧窗口要被新调用覆盖，先把还开着的upvalue关进堆里
+                    closeUpvalues(frame->slots);
+                    // 函数对象和入参挪到当前帧的窗口底部，丢弃旧的局部变量
+                    Value* base = frame->slots;
+                    for (int i = 0; i <= argCount; i++) {
+                        base[i] = vm.stackTop[-argCount - 1 + i];
+                    }
+                    vm.stackTop = base + argCount + 1;
+                    // 热函数计数照常走，尾递归循环也应该触发再优化
+                    ObjFunction* function = closure->function;
+                    if (function->callCount < HOT_FUNCTION_THRESHOLD &&
+                        ++function->callCount == HOT_FUNCTION_THRESHOLD) {
+                        optimizeFunction(function);
+                    }
+                    frame->closure = closure;
+                    frame->ip = function->chunk.code;
+                    DISPATCH_NEXT();
+                }
+                // native、类构造、绑定方法等走普通调用，
+                // 返回值由后面保留的OP_RETURN照常送回
+                if (!callValue(callee, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (vm.blockedChannel != NULL) {
+                    // 处理方式同OP_CALL，指令同样是2字节
+                    frame->ip -= 2;
+                    if (!suspendOnChannel()) {
+                        runtimeError("All fibers are blocked.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame = &vm.frames[vm.frameCount - 1];
+                    DISPATCH_NEXT();
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                DISPATCH_NEXT();
+            }
+            CASE(OP_INVOKE) : {
                 // 方法直接调用 instance.method()
                 // 方法名
                 ObjString* method = READ_STRING();
                 // 入参数量
                 int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+                // 这个调用点的内联缓存。CACHE_NONE代表该点没分到缓存槽
+                uint8_t cacheSlot = READ_BYTE();
+                PropertyCache* cache =
+                    cacheSlot == CACHE_NONE
+                        ? NULL
+                        : &frame->closure->function->chunk.caches[cacheSlot];
+                // 缓存内容存在函数对象的chunk里，填充前做一次写屏障
+                if (cache != NULL) {
+                    writeBarrier((Obj*)frame->closure->function);
+                }
+                if (!invoke(method, argCount, cache)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                // receive也可能存在实例字段里被invoke到，处理方式同OP_CALL，
+                // 只是指令长度是4字节（方法名、入参数量、缓存索引）
+                if (vm.blockedChannel != NULL) {
+                    frame->ip -= 4;
+                    if (!suspendOnChannel()) {
+                        runtimeError("All fibers are blocked.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame = &vm.frames[vm.frameCount - 1];
+                    DISPATCH_NEXT();
+                }
                 // 设置为方法的frame
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_SUPER_INVOKE: {
+            CASE(OP_SUPER_INVOKE) : {
                 // 父类函数直接调用
                 // 读取方法名
                 ObjString* method = READ_STRING();
@@ -630,14 +1507,14 @@ static InterpretResult run() {
                 ObjClass* superclass = AS_CLASS(pop());
 
                 // 调用父类的方法，相当于先获取父类，再OP_CALL。
-                if (!invokeFromClass(superclass, method, argCount)) {
+                if (!invokeFromClass(superclass, method, argCount, NULL)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 // 上面的方法会产生一个新的方法的frame，下一轮loop执行。所需要的入参和变量都在栈中
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_CLOSURE: {
+            CASE(OP_CLOSURE) : {
                 // 闭包函数声明指令
                 // 将函数对象包装成闭包对象
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
@@ -654,15 +1531,100 @@ static InterpretResult run() {
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
+                    // captureUpvalue会分配内存，循环中途闭包对象可能已被GC晋升
+                    writeBarrier((Obj*)closure);
+                }
+                DISPATCH_NEXT();
+            }
+            CASE(OP_CONSTANT_LONG) : {
+                // 24位大端常量索引
+                int index = READ_BYTE();
+                index = (index << 8) | READ_BYTE();
+                index = (index << 8) | READ_BYTE();
+                push(frame->closure->function->chunk.constants.values[index]);
+                DISPATCH_NEXT();
+            }
+            CASE(OP_CLOSURE_LONG) : {
+                // 和OP_CLOSURE一样，只是函数常量索引是24位的
+                int index = READ_BYTE();
+                index = (index << 8) | READ_BYTE();
+                index = (index << 8) | READ_BYTE();
+                ObjFunction* function = AS_FUNCTION(
+                    frame->closure->function->chunk.constants.values[index]);
+                ObjClosure* closure = newClosure(function);
+                push(OBJ_VAL(closure));
+                for (int i = 0; i < closure->upvalueCount; i++) {
+                    uint8_t isLocal = READ_BYTE();
+                    uint8_t slot = READ_BYTE();
+                    if (isLocal) {
+                        closure->upvalues[i] =
+                            captureUpvalue(frame->slots + slot);
+                    } else {
+                        closure->upvalues[i] = frame->closure->upvalues[slot];
+                    }
+                    writeBarrier((Obj*)closure);
+                }
+                DISPATCH_NEXT();
+            }
+            CASE(OP_BUILD_LIST) : {
+                // 列表字面量：收集栈顶的count个元素
+                int count = READ_BYTE();
+                // 元素都还留在栈上，建列表触发GC也不会丢
+                ObjList* list = newList();
+                push(OBJ_VAL(list));
+                for (int i = 0; i < count; i++) {
+                    // 扩容可能触发GC，列表本身在栈顶保着
+                    writeValueArray(&list->items, vm.stackTop[-1 - count + i]);
+                }
+                vm.stackTop -= count + 1;
+                push(OBJ_VAL(list));
+                DISPATCH_NEXT();
+            }
+            CASE(OP_GET_INDEX) : {
+                // 下标读。栈上依次是列表和索引
+                if (!IS_LIST(peek(1)) || !IS_NUMBER(peek(0))) {
+                    runtimeError("Can only index lists with numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjList* list = AS_LIST(peek(1));
+                int index = (int)AS_NUMBER(peek(0));
+                if (index < 0 || index >= list->items.count) {
+                    runtimeError("List index out of range.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                pop();
+                pop();
+                push(list->items.values[index]);
+                DISPATCH_NEXT();
+            }
+            CASE(OP_SET_INDEX) : {
+                // 下标写。栈上依次是列表、索引和值，整个表达式的值是写入的值
+                if (!IS_LIST(peek(2)) || !IS_NUMBER(peek(1))) {
+                    runtimeError("Can only index lists with numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjList* list = AS_LIST(peek(2));
+                int index = (int)AS_NUMBER(peek(1));
+                if (index < 0 || index >= list->items.count) {
+                    runtimeError("List index out of range.");
+                    return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                Value value = peek(0);
+                list->items.values[index] = value;
+                // 列表可能在老年代，写入的值可能是年轻对象
+                writeBarrier((Obj*)list);
+                pop();
+                pop();
+                pop();
+                push(value);
+                DISPATCH_NEXT();
             }
-            case OP_CLOSE_UPVALUE:
+            CASE(OP_CLOSE_UPVALUE) :
                 // 将一个栈上的本地变量，转入heap，作为闭包变量
                 closeUpvalues(vm.stackTop - 1);
                 pop();  // 还是要从栈里pop出去
-                break;
-            case OP_RETURN: {
+                DISPATCH_NEXT();
+            CASE(OP_RETURN) : {
                 // 获取返回值
                 Value result = pop();
                 // 把函数的变量全部闭包化
@@ -670,8 +1632,13 @@ static InterpretResult run() {
                 // 函数帧减一，代表当前函数执行结束了。
                 vm.frameCount--;
                 if (vm.frameCount == 0) {
-                    // 如果已经退到最后，说明脚本执行结束了
+                    // 当前fiber执行完了。队列里还有可运行的fiber就切过去，
+                    // 全部fiber跑完脚本才算结束（还在channel上等的直接丢弃）
                     pop();
+                    if (switchToNext()) {
+                        frame = &vm.frames[vm.frameCount - 1];
+                        DISPATCH_NEXT();
+                    }
                     return INTERPRET_OK;
                 }
                 // 丢弃执行完的函数帧在栈上的窗口，回到函数调用前的位置
@@ -683,14 +1650,14 @@ static InterpretResult run() {
                 // nil指令。 如果函数指定的return ，那么隐含的return
                 // nil则会因为frame的改变被跳过。
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_CLASS:
+            CASE(OP_CLASS) :
                 // 类声明，创建一个类对象，放入栈中。
                 // 后续defineVariable()函数会把这个类对象变成一个全局变量来处理
                 push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_INHERIT: {
+                DISPATCH_NEXT();
+            CASE(OP_INHERIT) : {
                 // 类继承，依次从栈上取出父类和子类
                 Value superclass = peek(1);
 
@@ -701,20 +1668,47 @@ static InterpretResult run() {
                 ObjClass* subclass = AS_CLASS(peek(0));
                 // 将父类的方法拷贝到子类中
                 tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+                // vtable也照搬。子类后面定义的同名方法会覆盖对应槽位
+                ObjClass* super = AS_CLASS(superclass);
+                for (int sel = 0; sel < super->vtableCapacity; sel++) {
+                    if (!IS_NIL(super->vtable[sel])) {
+                        vtableStore(subclass, sel, super->vtable[sel]);
+                    }
+                }
+                writeBarrier((Obj*)subclass);
                 pop();  // 把子类pop出来
                 // 父类留在栈顶，以供后面super关键字来使用
-                break;
+                DISPATCH_NEXT();
             }
-            case OP_METHOD:
+            CASE(OP_METHOD) :
                 // 方法定义。读取方法名
                 defineMethod(READ_STRING());
-                break;
+                DISPATCH_NEXT();
+            CASE(OP_NOP) :
+                // 指令合并留下的填充位，什么都不做
+                DISPATCH_NEXT();
+            CASE(OP_GET_LOCAL2) : {
+                // 连续读两个本地变量，省一次分发
+                uint8_t slotA = READ_BYTE();
+                uint8_t slotB = READ_BYTE();
+                push(frame->slots[slotA]);
+                push(frame->slots[slotB]);
+                DISPATCH_NEXT();
+            }
+        }
+#ifndef THREADED_DISPATCH
         }
     }
+#endif
+#undef CASE
+#undef DISPATCH_NEXT
+#undef TRACE_EXECUTION
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CONSTANT_LONG
+#undef READ_STRING_LONG
 #undef BINARY_OP
 }
 
@@ -723,12 +1717,18 @@ static InterpretResult run() {
  *
  * @return InterpretResult
  */
-InterpretResult interpret(const char* source) {
+InterpretResult interpret(VM* context, const char* source) {
+    vmCurrent = context;
     // 编译源码，返回顶级函数
     ObjFunction* function = compile(source);
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
 
+    return interpretFunction(context, function);
+}
+
+InterpretResult interpretFunction(VM* context, ObjFunction* function) {
+    vmCurrent = context;
     // 将函数对象放入执行栈
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
@@ -1,11 +1,14 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// 全局变量槽的硬上限：OP_GET/SET/DEFINE_GLOBAL_LONG的24位槽索引
+#define GLOBALS_MAX (1 << 24)
 
 // 函数调用帧，记录一个函数在执行中的状态
 typedef struct {
@@ -17,29 +20,111 @@ typedef struct {
                 // 每一次函数调用都会在VM的栈上开辟一个「窗口」，上面存放函数自己产生的入参、变量、值等，执行完了会丢弃掉。
 } CallFrame;
 
+// 绿色线程（fiber）。每个fiber有自己独立的栈段和调用帧数组，
+// 在一个VM（一个OS线程）里协作式调度：OP_LOOP回边和channel阻塞是切换点。
+// 成千上万个等待中的任务可以挂在fiber上，不占OS线程
+typedef struct ObjFiber {
+    Obj obj;
+    Value* stack;      // 该fiber独立的操作栈
+    Value* stackTop;   // 挂起时保存的栈顶（运行中以vm.stackTop为准）
+    CallFrame* frames;  // 该fiber独立的调用帧数组
+    int frameCount;  // 挂起时保存的帧数（运行中以vm.frameCount为准）
+    ObjUpvalue** openUpvalueSlots;  // 该fiber的按槽打开upvalue表
+    struct ObjFiber* next;  // 运行队列/channel等待队列里的链表指针
+    struct ObjFiber* allNext;  // 全量fiber链表指针。fiber的栈没法打写屏障，
+                               // minor GC要靠这条链找到老年代fiber重扫它们的栈
+} ObjFiber;
+
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
+
+// 创建一个空fiber（栈和帧数组已分配，还没有任何调用帧）
+ObjFiber* newFiber();
+
+// 一个全局变量槽。全局变量在编译期就被解析成了这个数组的索引，
+// 运行时直接按索引存取，不再每次访问都去哈希表里探测变量名。
+typedef struct {
+    ObjString* name;  // 变量名。报错信息和GC标记时使用
+    Value value;      // 当前值
+    bool defined;  // 是否已经执行过定义。全局变量是late-bound的，先引用后定义
+                   // 只要在运行到引用前完成定义就是合法的
+} GlobalVar;
+
+// GC运行统计。collectGarbage每轮累加，gcstats()原生函数
+// 和--gc-stats的退出汇总都从这里读
+typedef struct {
+    int minorCount;         // minor GC执行次数
+    int majorCount;         // major GC执行次数
+    size_t bytesReclaimed;  // 累计回收的字节数
+    double markTime;        // 根标记阶段累计耗时（秒）
+    double traceTime;       // 引用追踪阶段累计耗时（秒）
+    double sweepTime;       // 清扫阶段累计耗时（秒）
+    size_t peakBytes;       // bytesAllocated的历史峰值
+} GCStats;
+
 // 虚拟机对象
 typedef struct {
-    CallFrame frames
-        [FRAMES_MAX];  // 函数调用帧数组。每多一个函数嵌套调用数组会加一个元素，退出一层会减一
+    // 下面五个字段是当前fiber执行状态的「快照视图」，直接指向vm.fiber
+    // 里的数组，解释器主循环照旧用vm.frames/vm.stack访问。
+    // 切换fiber时把stackTop/frameCount存回旧fiber，再装载新fiber的
+    CallFrame* frames;  // 当前fiber的函数调用帧数组
     int frameCount;  // 当前执行中的函数帧数量，即有几个函数在嵌套执行中
-    Value stack[STACK_MAX];  // 操作栈
-    Value* stackTop;         // 栈顶元素（下一个空位置）
+    Value* stack;     // 当前fiber的操作栈
+    Value* stackTop;  // 栈顶元素（下一个空位置）
+
+    ObjFiber* fiber;    // 当前执行中的fiber。主脚本也跑在一个fiber上
+    ObjFiber* runHead;  // 可运行fiber队列头（FIFO）
+    ObjFiber* runTail;  // 可运行fiber队列尾
+    ObjFiber* allFibers;  // 所有存活fiber的链表（经allNext），GC用
+    ObjChannel* blockedChannel;  // receive在空channel上等待时由native填上，
+                                 // 调用指令看到后把当前fiber挂起
+    int switchBudget;  // 还剩几个OP_LOOP回边轮转一次fiber，防止单个fiber饿死别人
+
     Table
         strings;  // 字符串缓存哈希表。运行时会缓存所有的字符串，相同的字符串会使用同一个对象。
-    Table globals;             // 全局变量
+    Table globalNames;  // 全局变量名 ->
+                        // 槽索引。只在编译期（REPL下每行都会编译）使用，
+                        // 保证多次interpret之间槽索引稳定
+    GlobalVar* globals;  // 全局变量槽数组，按索引直接存取，按需扩容
+    int globalCount;     // 已分配的全局变量槽数量
+    int globalCapacity;  // globals数组当前总容量
+
+    int selectorCount;  // 已分配的方法selector编号数量。每个方法名第一次
+                        // 被定义时领一个编号，编号挂在方法名字符串上
 
     ObjString* initString; // 类的init方法名
 
-    ObjUpvalue* openUpvalues;  // vm中所有的闭包变量
+    ObjUpvalue** openUpvalueSlots;  // 当前fiber的按栈槽索引打开upvalue表。
+                                    // openUpvalueSlots[i]是指向stack[i]的
+                                    // upvalue（没有则为NULL），捕获和关闭
+                                    // 都是O(1)按槽直达，不用再遍历链表
     Obj*
-        objects;  // Obj链表，保存VM中所有的Obj对象引用，VM退出的时候释放掉这些内存
+        objects;  // 年轻代Obj链表。新分配的对象都挂在这里，minor GC只扫这条链
+    Obj* oldObjects;  // 老年代Obj链表。熬过一次minor GC的对象晋升到这里
+
+    Obj** remembered;  // 记忆集：写入过年轻对象引用的老年代对象，minor
+                       // GC时当作额外的根
+    int rememberedCount;     // 记忆集数量
+    int rememberedCapacity;  // 记忆集容量
 
     int grayCount;     // gray对象数量
     int grayCapacity;  // grayStack数组容量
     Obj** grayStack;   // GC时正在遍历中的对象
+    bool parallelMarking;  // 本VM的trace阶段是否在多线程跑。为true时对
+                           // grayStack的push必须拿锁。放在VM里而不是进程级，
+                           // 别的线程的VM正在GC不影响本VM
+    int busyWorkers;  // 正在blacken对象的worker数，由memory.c的grayMutex保护
 
     size_t bytesAllocated; // 已经开辟的所有堆内存大小
-    size_t nextGC;  // 触发GC的堆内存容量大小
+    size_t nextGC;       // 触发minor GC的堆内存容量大小
+    size_t nextMajorGC;  // 触发major GC（全堆标记清除）的堆内存容量大小
+    bool gcMinor;  // 当前这轮GC是否是minor。minor只回收年轻代，老年代默认存活
+    double gcGrowFactor;  // 每轮GC后nextGC = 存活堆 * 这个倍数。
+                          // 可用LOX_GC_GROW环境变量覆盖
+    GCStats gcStats;      // GC统计计数
+
+    void* poolFree[POOL_CLASS_COUNT];  // 小对象内存池：每档的空闲块链表
+    void* poolSlabs;  // 内存池向系统申请过的所有slab，freeVM时整体归还
 } VM;
 
 typedef enum {
@@ -48,13 +133,32 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+// 当前线程绑定的VM上下文。API入口（initVM/interpret等）会把调用方传入的
+// VM*绑到这里，VM内部实现继续通过下面的vm宏访问，不用把指针穿透每个函数。
+// 每个线程各绑各的上下文，一个线程跑一个VM时互不干扰
+extern _Thread_local VM* vmCurrent;
+#define vm (*vmCurrent)
 
-void initVM();
+/**
+ * @brief 初始化一个VM上下文。每个上下文有独立的堆、字符串缓存和GC状态，
+ * 不同线程上各初始化一个就可以并行执行互不相干的脚本
+ *
+ * @param context 调用方提供的VM存储
+ */
+void initVM(VM* context);
 
-InterpretResult interpret(const char* source);
+InterpretResult interpret(VM* context, const char* source);
 
-void freeVM();
+/**
+ * @brief 直接执行一个编译好的顶级函数（比如从字节码文件加载的）
+ *
+ * @param context VM上下文
+ * @param function 顶级函数
+ * @return InterpretResult
+ */
+InterpretResult interpretFunction(VM* context, ObjFunction* function);
+
+void freeVM(VM* context);
 /**
  * @brief 栈中放入值
  *
@@ -69,4 +173,23 @@ void push(Value value);
  */
 Value pop();
 
+/**
+ * @brief 解析全局变量名对应的槽索引，不存在时分配一个新槽。
+ * 编译器在编译期调用，保证同名全局变量在多次编译之间使用同一个槽。
+ *
+ * @param name 变量名
+ * @return int 槽索引，槽已用完时返回-1
+ */
+int vmGlobalSlot(ObjString* name);
+
+/**
+ * @brief 把方法挂到类上：methods表、selector编号、vtable三处一起更新。
+ * 解释器的OP_METHOD和堆镜像恢复路径共用这一个入口。
+ *
+ * @param klass 类
+ * @param name 方法名
+ * @param method 方法闭包
+ */
+void vmAddMethod(ObjClass* klass, ObjString* name, Value method);
+
 #endif
\ No newline at end of file
@@ -2,10 +2,15 @@ package com.milkygreen.jlox;
 
 /**
  * break声明。以异常的方式中断循环
+ * 构造时关掉了堆栈采集，且解释器是单线程的，复用一个预分配实例即可，
+ * 每次break不再产生任何分配
  */
 public class Break extends RuntimeException {
 
-    Break() {
+    // 预分配的共享实例，break本身不携带状态
+    static final Break INSTANCE = new Break();
+
+    private Break() {
         super(null, null, false, false);
 
     }
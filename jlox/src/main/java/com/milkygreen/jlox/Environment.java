@@ -4,7 +4,10 @@ import java.util.HashMap;
 import java.util.Map;
 
 /**
- * 上下文环境，主要用来保存一个作用域中的变量
+ * 上下文环境，主要用来保存一个作用域中的变量。
+ * 局部作用域里的变量在Resolver阶段已经静态地确定了(层级,槽索引)，
+ * 这里直接用Object数组按槽索引存取，不再每次访问都做HashMap查找和hash计算。
+ * 全局作用域是late-bound的（先使用后定义也合法），Resolver不管它，仍按名字存在Map里。
  */
 class Environment {
 
@@ -14,74 +17,90 @@ class Environment {
     final Environment enclosing;
 
     /**
-     * 该作用域里面定义的变量和值
+     * 局部作用域的变量槽。Resolver按声明顺序分配槽索引，
+     * 运行时define也按声明顺序执行，两边的索引天然一致
      */
-    private final Map<String, Object> values = new HashMap<>();
+    private Object[] slots;
+
+    /**
+     * 已定义的槽数量
+     */
+    private int slotCount = 0;
+
+    /**
+     * 全局作用域的变量和值，按名字存取。局部作用域不用
+     */
+    private final Map<String, Object> values;
 
     Environment() {
+        // 无参构造只用于全局作用域
         enclosing = null;
+        values = new HashMap<>();
     }
 
     Environment(Environment enclosing) {
         this.enclosing = enclosing;
+        this.slots = new Object[4];
+        this.values = null;
     }
 
     /**
-     * 定义一个变量
+     * 定义一个变量。局部作用域追加到下一个空槽，全局作用域放进Map
      * @param name 变量名
      * @param value 变量值
+     * @return 分配的槽索引，全局变量返回-1
      */
-    void define(String name, Object value) {
-        values.put(name, value);
+    int define(String name, Object value) {
+        if (values != null) {
+            values.put(name, value);
+            return -1;
+        }
+        if (slotCount == slots.length) {
+            Object[] bigger = new Object[slots.length * 2];
+            System.arraycopy(slots, 0, bigger, 0, slotCount);
+            slots = bigger;
+        }
+        slots[slotCount] = value;
+        return slotCount++;
     }
 
     /**
-     * 查询一个变量的值
+     * 按名字查询一个变量的值。只有全局变量会走到这里（Resolver没解析出层级的）
      * @param name 变量名
      * @return 值
      */
     Object get(Token name) {
-        if (values.containsKey(name.lexeme)) {
+        if (values != null && values.containsKey(name.lexeme)) {
             return values.get(name.lexeme);
         }
 
-        // 如果在该作用域没找到，向父作用域查找
-        if (enclosing != null) {
-            return enclosing.get(name);
-        }
-
         throw new RuntimeError(name,
                 "Undefined variable '" + name.lexeme + "'.");
     }
 
     /**
-     * 给变量重新复制
+     * 按名字给变量重新赋值。只有全局变量会走到这里
      * @param name 变量名
      * @param value 变量的新值
      */
     void assign(Token name, Object value) {
-        if (values.containsKey(name.lexeme)) {
+        if (values != null && values.containsKey(name.lexeme)) {
             values.put(name.lexeme, value);
             return;
         }
-        // 当前作用域没有的话交给上层操作
-        if (enclosing != null) {
-            enclosing.assign(name, value);
-            return;
-        }
 
         throw new RuntimeError(name,
                 "Undefined variable '" + name.lexeme + "'.");
     }
 
     /**
-     * 查到指定层级的变量值
-     * @param distance
-     * @param name
+     * 查指定层级上指定槽的变量值
+     * @param distance 层级
+     * @param slot 槽索引
      * @return
      */
-    Object getAt(int distance, String name) {
-        return ancestor(distance).values.get(name);
+    Object getAt(int distance, int slot) {
+        return ancestor(distance).slots[slot];
     }
 
     /**
@@ -98,7 +117,7 @@ class Environment {
         return environment;
     }
 
-    void assignAt(int distance, Token name, Object value) {
-        ancestor(distance).values.put(name.lexeme, value);
+    void assignAt(int distance, int slot, Object value) {
+        ancestor(distance).slots[slot] = value;
     }
 }
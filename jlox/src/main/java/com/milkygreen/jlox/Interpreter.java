@@ -19,6 +19,8 @@ public class Interpreter implements Expr.Visitor<Object>,
 
     // Resolver通过静态分析，记录的每个变量应该在哪一层的上下文中查找
     private final Map<Expr, Integer> locals = new HashMap<>();
+    // Resolver记录的每个变量在它那一层上下文里的槽索引
+    private final Map<Expr, Integer> slots = new HashMap<>();
 
 
     Interpreter() {
@@ -72,12 +74,14 @@ public class Interpreter implements Expr.Visitor<Object>,
     }
 
     /**
-     * 记录变量和定义它的上下文层级
+     * 记录变量和定义它的上下文层级、槽索引
      * @param expr
      * @param depth
+     * @param slot
      */
-    void resolve(Expr expr, int depth) {
+    void resolve(Expr expr, int depth, int slot) {
         locals.put(expr, depth);
+        slots.put(expr, slot);
     }
 
     /**
@@ -224,11 +228,11 @@ public class Interpreter implements Expr.Visitor<Object>,
     @Override
     public Object visitSuperExpr(Expr.Super expr) {
         int distance = locals.get(expr);    // super当做变量来解析，查找目标和当前上下文的距离
-        LoxClass superclass = (LoxClass)environment.getAt(distance, "super");   // 找出父类
-        // 在super的下一层可以找到 this 子类实例。
+        LoxClass superclass = (LoxClass)environment.getAt(distance, slots.get(expr));   // 找出父类
+        // 在super的下一层可以找到 this 子类实例（this是它那层scope的唯一变量，槽索引0）。
         // 因为super表达式一定处于一个方法的调用过程中，而每个方法的在调用之前都是绑定了自己的this的。
         // 且super所在的上下文位于this上下文上一层的位置。具体可见类声明方法。
-        LoxInstance instance = (LoxInstance)environment.getAt(distance - 1, "this");
+        LoxInstance instance = (LoxInstance)environment.getAt(distance - 1, 0);
         // 找到父类的方法
         LoxFunction method = superclass.findMethod(expr.method.lexeme);
         if (method == null) {
@@ -379,7 +383,7 @@ public class Interpreter implements Expr.Visitor<Object>,
         // 先取层级
         Integer distance = locals.get(expr);
         if (distance != null) {
-            return environment.getAt(distance, name.lexeme);
+            return environment.getAt(distance, slots.get(expr));
         } else {
             // 没有层级的是全局变量
             return globals.get(name);
@@ -397,7 +401,7 @@ public class Interpreter implements Expr.Visitor<Object>,
 
         Integer distance = locals.get(expr);
         if (distance != null) {
-            environment.assignAt(distance, expr.name, value);
+            environment.assignAt(distance, slots.get(expr), value);
         } else {
             globals.assign(expr.name, value);
         }
@@ -470,8 +474,10 @@ public class Interpreter implements Expr.Visitor<Object>,
             }
         }
 
-        // 将类声明放入上下文，此时值是null，代表还没解析完
-        environment.define(stmt.name.lexeme, null);
+        // 将类声明放入上下文，此时值是null，代表还没解析完。
+        // 记住定义它的环境和槽，后面super环境入栈出栈之后还要回填
+        Environment classEnvironment = environment;
+        int classSlot = environment.define(stmt.name.lexeme, null);
 
         // 如果有父类，需要把super关键字放入上下文中。这样每个方法的上下文路径中都会有super
         if (stmt.superclass != null) {
@@ -493,8 +499,12 @@ public class Interpreter implements Expr.Visitor<Object>,
             environment = environment.enclosing;
         }
 
-        // 更新上下文
-        environment.assign(stmt.name, klass);
+        // 回填解析完的类对象。局部作用域按定义时拿到的槽回填，全局的按名字
+        if (classSlot >= 0) {
+            classEnvironment.assignAt(0, classSlot, klass);
+        } else {
+            globals.assign(stmt.name, klass);
+        }
         return null;
     }
 
@@ -560,14 +570,15 @@ public class Interpreter implements Expr.Visitor<Object>,
         if (stmt.value != null){
             value = evaluate(stmt.value);
         }
-        // return是通过抛一个特殊的异常的实现的
-        throw new Return(value);
+        // return是通过抛一个特殊的异常的实现的，复用预分配的实例，只填返回值
+        Return.INSTANCE.value = value;
+        throw Return.INSTANCE;
     }
 
     @Override
     public Void visitBreakStmt(Stmt.Break stmt) {
-        // 抛一个break异常来打断循环
-        throw new Break();
+        // 抛一个break异常来打断循环，复用预分配的实例
+        throw Break.INSTANCE;
     }
 
     /**
@@ -45,17 +45,22 @@ public class LoxFunction implements LoxCallable {
             // 方法体当做代码块来执行
             interpreter.executeBlock(declaration.body, environment);
         } catch (Return returnValue) {
-            // 初始化方法中也允许return，不过只会return类的实例
+            // 对于函数的return，按照一个异常来处理，这样可以很方便的跳过后面的代码直接返回。
+            // 异常实例是共享的，先把返回值取出来、清掉字段，免得静态实例一直攥着最后一个返回值
+            Object value = returnValue.value;
+            returnValue.value = null;
+
+            // 初始化方法中也允许return，不过只会return类的实例。
+            // init一定是bind过的，closure就是this所在的环境，this占槽0
             if (isInitializer){
-                return closure.getAt(0, "this");
+                return closure.getAt(0, 0);
             }
 
-            // 对于函数的return，按照一个异常来处理，这样可以很方便的跳过后面的代码直接返回
-            return returnValue.value;
+            return value;
         }
         // 如果是构造方法需要return 新建的类实例
         if (isInitializer){
-            return closure.getAt(0, "this");
+            return closure.getAt(0, 0);
         }
         return null;
     }
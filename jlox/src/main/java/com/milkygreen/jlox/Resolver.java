@@ -17,8 +17,20 @@ public class Resolver implements Expr.Visitor<Void>,Stmt.Visitor<Void>{
 
     private final Interpreter interpreter;
 
-    // 作用域，每进入一个块就会push一个作用域，出来块之后pop掉。目的是提前确定使用一个变量的时候，应该向上找几层
-    private final Stack<Map<String, Boolean>> scopes = new Stack<>();
+    // 作用域里一个变量的静态信息
+    private static class Variable {
+        final int slot;     // 在该作用域Environment里的槽索引，按声明顺序分配
+        boolean defined;    // 是否已初始化完。false代表仅声明，防止 var a = a
+
+        Variable(int slot, boolean defined) {
+            this.slot = slot;
+            this.defined = defined;
+        }
+    }
+
+    // 作用域，每进入一个块就会push一个作用域，出来块之后pop掉。目的是提前确定使用一个变量的时候，
+    // 应该向上找几层、以及在那一层的第几个槽
+    private final Stack<Map<String, Variable>> scopes = new Stack<>();
     // 标记当前是否处于一个函数中，仅对return起作用
     private FunctionType currentFunction = FunctionType.NONE;
 
@@ -134,8 +146,11 @@ public class Resolver implements Expr.Visitor<Void>,Stmt.Visitor<Void>{
     public Void visitVariableExpr(Expr.Variable expr) {
         // 变量的使用
         // 如果已经声明同名变量但是还没初始化，说明当前处于该变量的初始化代码中，一个变量不能在初始化代码中引用自己。比如var a = a
-        if (!scopes.isEmpty() && scopes.peek().get(expr.name.lexeme) == Boolean.FALSE) {
-            Lox.error(expr.name, "Can't read local variable in its own initializer.");
+        if (!scopes.isEmpty()) {
+            Variable variable = scopes.peek().get(expr.name.lexeme);
+            if (variable != null && !variable.defined) {
+                Lox.error(expr.name, "Can't read local variable in its own initializer.");
+            }
         }
 
         resolveLocal(expr, expr.name);
@@ -150,9 +165,10 @@ public class Resolver implements Expr.Visitor<Void>,Stmt.Visitor<Void>{
     private void resolveLocal(Expr expr, Token name) {
         // 依次从近到远遍历stack，找到变量为止
         for (int i = scopes.size() - 1; i >= 0; i--) {
-            if (scopes.get(i).containsKey(name.lexeme)) {
-                // 找到了，交给interpreter记录一下层数。这样后面运行的时候可以直接去指定位置查询变量
-                interpreter.resolve(expr, scopes.size() - 1 - i);
+            Variable variable = scopes.get(i).get(name.lexeme);
+            if (variable != null) {
+                // 找到了，交给interpreter记录层数和槽索引。这样后面运行的时候可以直接按(层级,槽)定位变量
+                interpreter.resolve(expr, scopes.size() - 1 - i, variable.slot);
                 return;
             }
         }
@@ -199,15 +215,15 @@ public class Resolver implements Expr.Visitor<Void>,Stmt.Visitor<Void>{
 
         // 如果有父类，增加super关键字
         if (stmt.superclass != null) {
-            // 新增一个scope，专门存放super变量
+            // 新增一个scope，专门存放super变量，它是这个scope里唯一的变量，槽索引0
             beginScope();
-            scopes.peek().put("super", true);
+            scopes.peek().put("super", new Variable(0, true));
         }
 
         // 类里面属于一个新scope
         beginScope();
-        // 把this关键字放进去
-        scopes.peek().put("this", true);
+        // 把this关键字放进去，同样是所在scope的唯一变量，槽索引0
+        scopes.peek().put("this", new Variable(0, true));
 
         // 解析类里的方法
         for (Stmt.Function method : stmt.methods) {
@@ -229,7 +245,7 @@ public class Resolver implements Expr.Visitor<Void>,Stmt.Visitor<Void>{
     }
 
     private void beginScope() {
-        scopes.push(new HashMap<String, Boolean>());
+        scopes.push(new HashMap<String, Variable>());
     }
 
     private void endScope() {
@@ -352,13 +368,14 @@ public class Resolver implements Expr.Visitor<Void>,Stmt.Visitor<Void>{
             return;
         }
 
-        Map<String, Boolean> scope = scopes.peek();
+        Map<String, Variable> scope = scopes.peek();
         // 同一个scope不能重复声明相同变量
         if (scope.containsKey(name.lexeme)) {
             Lox.error(name, "Already a variable with this name in this scope.");
         }
-        // false代表仅仅做了声明，还没初始化
-        scope.put(name.lexeme, false);
+        // 槽索引按声明顺序分配，和运行时Environment.define的追加顺序一一对应。
+        // defined=false代表仅仅做了声明，还没初始化
+        scope.put(name.lexeme, new Variable(scope.size(), false));
     }
 
     /**
@@ -369,8 +386,8 @@ public class Resolver implements Expr.Visitor<Void>,Stmt.Visitor<Void>{
         if (scopes.isEmpty()){
             return;
         }
-        // true 表明变量已经可以供别人使用了
-        scopes.peek().put(name.lexeme, true);
+        // defined=true 表明变量已经可以供别人使用了
+        scopes.peek().get(name.lexeme).defined = true;
     }
 
     @Override
@@ -2,15 +2,20 @@ package com.milkygreen.jlox;
 
 /**
  * 函数或方法的return语句
- * 直接将return定义为一个异常，可以方便的直接抛到函数最外层
+ * 直接将return定义为一个异常，可以方便的直接抛到函数最外层。
+ * 构造时关掉了堆栈采集。解释器是单线程的，抛出后马上会被最近的函数调用捕获、
+ * 读走value，中间不可能再抛第二个return，所以复用一个预分配实例，
+ * 每次return只是改一下value字段，不再构造异常对象
  */
 public class Return extends RuntimeException {
 
-    // 返回值
-    final Object value;
+    // 预分配的共享实例
+    static final Return INSTANCE = new Return();
 
-    Return(Object value) {
+    // 返回值，抛出前由visitReturnStmt填入
+    Object value;
+
+    private Return() {
         super(null, null, false, false);
-        this.value = value;
     }
 }